@@ -0,0 +1,96 @@
+#include "copy.h"
+#include "constants.h"
+
+/*
+ * Candidate copy and fill for local memory and DMA BRAM, timed by copy_bench.c
+ * against Xil_MemCpy, memcpy and memset before the DRM uses them anywhere
+ *
+ * Nothing is cached and the core has no barrel shifter to merge misaligned
+ * words, so a copy costs one bus transfer per load and store plus the loop
+ * around them. When both sides share an alignment, bytes are moved up to a
+ * word boundary and the rest eight words a pass, leaving at most seven words
+ * and three bytes (e.g. of a chunk_remainder) for the tail loops. Buffers at
+ * different alignments are copied a byte at a time.
+ */
+
+// Word accesses into byte buffers
+typedef u32 __attribute__((may_alias)) word;
+
+// Keeps GCC from turning the loops back into memcpy and memset calls
+#define NO_LIBCALL __attribute__((optimize("no-tree-loop-distribute-patterns")))
+
+/*
+ * Copies len bytes from src to dst, the buffers must not overlap
+ */
+HOT_CODE NO_LIBCALL void copy_mem(void *dst, const void *src, u32 len) {
+	u8 *d = dst;
+	const u8 *s = src;
+
+	if (!(((UINTPTR)d ^ (UINTPTR)s) & 3)) {
+		word *dw;
+		const word *sw;
+
+		// bytes up to the first word boundary of both
+		while (len && ((UINTPTR)d & 3)) {
+			*d++ = *s++;
+			len--;
+		}
+
+		dw = (word *)d;
+		sw = (const word *)s;
+
+		// all loads before the stores, so none waits on the load before it
+		for (; len >= 32; len -= 32, dw += 8, sw += 8) {
+			u32 w0 = sw[0], w1 = sw[1], w2 = sw[2], w3 = sw[3];
+			u32 w4 = sw[4], w5 = sw[5], w6 = sw[6], w7 = sw[7];
+
+			dw[0] = w0; dw[1] = w1; dw[2] = w2; dw[3] = w3;
+			dw[4] = w4; dw[5] = w5; dw[6] = w6; dw[7] = w7;
+		}
+
+		for (; len >= 4; len -= 4) {
+			*dw++ = *sw++;
+		}
+
+		d = (u8 *)dw;
+		s = (const u8 *)sw;
+	}
+
+	while (len--) {
+		*d++ = *s++;
+	}
+}
+
+/*
+ * Sets len bytes at dst to value
+ */
+HOT_CODE NO_LIBCALL void copy_fill(void *dst, u8 value, u32 len) {
+	u8 *d = dst;
+	word *dw;
+	u32 w;
+
+	while (len && ((UINTPTR)d & 3)) {
+		*d++ = value;
+		len--;
+	}
+
+	// no multiplier, so the byte is spread with shifts
+	w = value;
+	w |= w << 8;
+	w |= w << 16;
+
+	dw = (word *)d;
+	for (; len >= 32; len -= 32, dw += 8) {
+		dw[0] = w; dw[1] = w; dw[2] = w; dw[3] = w;
+		dw[4] = w; dw[5] = w; dw[6] = w; dw[7] = w;
+	}
+
+	for (; len >= 4; len -= 4) {
+		*dw++ = w;
+	}
+
+	d = (u8 *)dw;
+	while (len--) {
+		*d++ = value;
+	}
+}
@@ -0,0 +1,8 @@
+#ifndef COPY_H
+#define COPY_H
+#include "xil_types.h"
+
+void copy_mem(void *dst, const void *src, u32 len);
+void copy_fill(void *dst, u8 value, u32 len);
+
+#endif
@@ -0,0 +1,100 @@
+/*
+ * Cycle counts of the copies the DRM makes, booted under qemu-system-microblazeel by `make copy-bench`.
+ * Times the copy_mem and copy_fill candidates in copy.c against the standalone BSP's Xil_MemCpy (sim_bsp.c
+ * has the same loop) and newlib's memcpy and memset. Audio goes from local memory into the DMA BRAM
+ * stand-in, the nonce and tag between local buffers. Prints one line per routine and case:
+ *   <case> <routine> <bytes> <timer cycles for REPS calls> <REPS>
+ * followed by "done"; runSim converts the cycles into instructions per call.
+ */
+#include <string.h>
+#include "xparameters.h"
+#include "xil_io.h"
+#include "xil_mem.h"
+#include "xil_printf.h"
+#include "constants.h"
+#include "copy.h"
+
+// the simulated machine's AXI timer, free running once started in main
+#define bench_clock() Xil_In32(XPAR_TMRCTR_0_BASEADDR + 0x8)
+
+// calls per measurement, the timer only ticks about once every 16 instructions
+#define REPS 64
+
+#define BRAM ((u8 *) XPAR_MB_DMA_AXI_BRAM_CTRL_0_S_AXI_BASEADDR)
+
+typedef void (*copy_fn)(void *dst, const void *src, u32 len);
+typedef void (*fill_fn)(void *dst, u8 value, u32 len);
+
+static u8 chunk[CHUNK_SZ + 4] __attribute__((aligned(4)));
+static u8 local[64] __attribute__((aligned(4)));
+
+static void lib_memcpy(void *dst, const void *src, u32 len) {
+	memcpy(dst, src, len);
+}
+
+static void lib_memset(void *dst, u8 value, u32 len) {
+	memset(dst, value, len);
+}
+
+static const struct {
+	const char *name;
+	copy_fn copy;
+} copies[] = {
+	{"Xil_MemCpy", Xil_MemCpy},
+	{"memcpy", lib_memcpy},
+	{"copy_mem", copy_mem},
+};
+
+static const struct {
+	const char *name;
+	fill_fn fill;
+} fills[] = {
+	{"memset", lib_memset},
+	{"copy_fill", copy_fill},
+};
+
+static const struct {
+	const char *name;
+	u8 *dst;
+	const u8 *src;
+	u32 len;
+} copy_cases[] = {
+	{"chunk", BRAM, chunk, CHUNK_SZ},
+	{"remainder", BRAM, chunk, 4003},       // the last chunk of a song, not a whole number of words
+	{"misaligned", BRAM + 1, chunk, 4000},  // source and destination at different offsets into a word
+	{"nonce", local, chunk + 4, NONCE_SIZE},
+	{"tag", local + 16, chunk + 4, MAC_SIZE},
+};
+
+static void report(const char *what, const char *routine, u32 len, u32 cycles) {
+	xil_printf("%s %s %u %u %u\r\n", what, routine, len, cycles, REPS);
+}
+
+int main() {
+	// load 0 into the counter, then let it count up and auto reload forever
+	Xil_Out32(XPAR_TMRCTR_0_BASEADDR + 0x4, 0);
+	Xil_Out32(XPAR_TMRCTR_0_BASEADDR + 0x0, 0x20);
+	Xil_Out32(XPAR_TMRCTR_0_BASEADDR + 0x0, 0x90);
+	xil_printf("clock %u\r\n", XPAR_TMRCTR_0_CLOCK_FREQ_HZ);
+
+	for (int i = 0; i < sizeof(copy_cases) / sizeof(copy_cases[0]); i++) {
+		for (int j = 0; j < sizeof(copies) / sizeof(copies[0]); j++) {
+			u32 start = bench_clock();
+			for (int r = 0; r < REPS; r++) {
+				copies[j].copy(copy_cases[i].dst, copy_cases[i].src, copy_cases[i].len);
+			}
+			report(copy_cases[i].name, copies[j].name, copy_cases[i].len, bench_clock() - start);
+		}
+	}
+
+	for (int j = 0; j < sizeof(fills) / sizeof(fills[0]); j++) {
+		u32 start = bench_clock();
+		for (int r = 0; r < REPS; r++) {
+			fills[j].fill(BRAM + SILENCE_OFFSET, 0, SILENCE_SZ);
+		}
+		report("silence", fills[j].name, SILENCE_SZ, bench_clock() - start);
+	}
+
+	xil_printf("done\r\n");
+	while (1) continue;
+}
@@ -0,0 +1,86 @@
+/*
+ * Host build of the idle scheduler (../src/idle.c) for measuring it without a board or QEMU.
+ * SIGALRM stands in for the command interrupt and sigsuspend for mbar 16. The DRM has no timer, so
+ * wake latencies are timed here with CLOCK_MONOTONIC, in ns. Waits for a number of periodic "commands"
+ * and prints the idle proxy (polling spins and CPU time) and the wake latency.
+ * `make idle-bench` builds and runs it with IDLE_SLEEP=1 and IDLE_SLEEP=0.
+ * Use: idle_host [commands] [period_us]
+ */
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "xil_types.h"
+
+static u32 host_clock(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u32)(ts.tv_sec * 1000000000ULL + ts.tv_nsec);
+}
+
+#include "idle.c"
+
+telemetry tm;
+
+// clock at the last interrupt and the total time from there to the waiter running again
+static volatile u32 raised_at;
+static unsigned long long latency_ns;
+
+static sigset_t irq;
+
+// sigsuspend unblocks the interrupt and sleeps in one step, as the window fixup does on the core
+void idle_sleep(const volatile u32 *seq, u32 seen) {
+	sigset_t old;
+
+	sigprocmask(SIG_BLOCK, &irq, &old);
+	if (*seq == seen) {
+		sigsuspend(&old);
+	}
+	sigprocmask(SIG_SETMASK, &old, NULL);
+}
+
+void idle_fixup_return(void) {
+}
+
+static void isr(int sig) {
+	raised_at = host_clock();
+	idle_notify(WAKE_CMD);
+}
+
+static double seconds(struct timeval tv) {
+	return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+int main(int argc, char **argv) {
+	int commands = argc > 1 ? atoi(argv[1]) : 200;
+	long period_us = argc > 2 ? atol(argv[2]) : 5000;
+	struct sigaction sa;
+	struct itimerval timer = {{0, period_us}, {0, period_us}};
+	struct rusage usage;
+
+	sigemptyset(&irq);
+	sigaddset(&irq, SIGALRM);
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = isr;
+	sigaction(SIGALRM, &sa, NULL);
+	setitimer(ITIMER_REAL, &timer, NULL);
+
+	// the DRM's command loop, with no work per command
+	for (int i = 0; i < commands; i++) {
+		idle_wait(WAKE_CMD);
+		latency_ns += (u32)(host_clock() - raised_at);
+		idle_take(WAKE_CMD);
+	}
+
+	getrusage(RUSAGE_SELF, &usage);
+	printf("IDLE_SLEEP=%d: %d commands every %ld us\n", IDLE_SLEEP, commands, period_us);
+	printf("  sleeps %u, polling spins %llu\n", tm.idle_sleeps, (unsigned long long) tm.idle_spins);
+	printf("  cpu time %.1f ms of %.1f ms\n", (seconds(usage.ru_utime) + seconds(usage.ru_stime)) * 1e3,
+			commands * period_us / 1e3);
+	printf("  wake latency %llu ns average\n", latency_ns / commands);
+	return 0;
+}
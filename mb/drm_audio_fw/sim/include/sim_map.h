@@ -0,0 +1,40 @@
+#ifndef SIM_MAP_H
+#define SIM_MAP_H
+
+// Address map of the simulated board, QEMU's petalogix-s3adsp1800 machine:
+// 128KB of LMB at 0, the same as the Cora design, and DDR at 0x90000000 backed by a host file.
+// Everything below is forced into every firmware file with -include, override with -D to match another QEMU.
+
+#ifndef SIM_DDR_BASE
+#define SIM_DDR_BASE        0x90000000
+#endif
+#ifndef SIM_UART_BASE
+#define SIM_UART_BASE       0x84000000  // xps-uartlite, the console
+#endif
+#ifndef SIM_INTC_BASE
+#define SIM_INTC_BASE       0x81800000  // xps-intc
+#endif
+#ifndef SIM_TIMER_BASE
+#define SIM_TIMER_BASE      0x83C00000  // xps-timer, timer 0 counts cycles and timer 1 polls the doorbell
+#endif
+#ifndef SIM_TIMER_HZ
+#define SIM_TIMER_HZ        62000000
+#endif
+#ifndef SIM_TIMER_IRQ
+#define SIM_TIMER_IRQ       0
+#endif
+
+// Offsets into DDR, and so into the host file. miPod (built with MIPOD_SIM) maps the same offsets.
+#define SIM_CHANNEL_OFFSET  0x04000000  // cmd_channel
+#define SIM_DMA_OFFSET      0x07000000  // stands in for the DMA BRAM
+#define SIM_FIFO_OFFSET     0x07010000  // FIFO fill level the GPIO would report
+#define SIM_PWM_OFFSET      0x07011000  // RGB LED registers
+#define SIM_DOORBELL_OFFSET 0x07012000  // miPod bumps this word instead of raising the GPIO interrupt
+
+#define SHARED_DDR_BASE     (SIM_DDR_BASE + SIM_CHANNEL_OFFSET)
+#define SIM_DOORBELL        (SIM_DDR_BASE + SIM_DOORBELL_OFFSET)
+
+// Doorbell poll period in timer 1 ticks, 100us
+#define SIM_POLL_TICKS      (SIM_TIMER_HZ / 10000)
+
+#endif
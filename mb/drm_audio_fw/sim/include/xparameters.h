@@ -0,0 +1,23 @@
+#ifndef SIM_XPARAMETERS_H
+#define SIM_XPARAMETERS_H
+
+// The board's parameters, with the peripherals QEMU lacks moved into scratch DDR, see sim_map.h
+#include_next <xparameters.h>
+#include "sim_map.h"
+
+#undef XPAR_MB_DMA_AXI_BRAM_CTRL_0_S_AXI_BASEADDR
+#define XPAR_MB_DMA_AXI_BRAM_CTRL_0_S_AXI_BASEADDR (SIM_DDR_BASE + SIM_DMA_OFFSET)
+#undef XPAR_FIFO_COUNT_AXI_GPIO_0_BASEADDR
+#define XPAR_FIFO_COUNT_AXI_GPIO_0_BASEADDR (SIM_DDR_BASE + SIM_FIFO_OFFSET)
+#undef XPAR_RGB_PWM_0_PWM_AXI_BASEADDR
+#define XPAR_RGB_PWM_0_PWM_AXI_BASEADDR (SIM_DDR_BASE + SIM_PWM_OFFSET)
+
+// No caches on the real core either, keep platform.c from calling into them
+#undef XPAR_MICROBLAZE_USE_ICACHE
+#undef XPAR_MICROBLAZE_USE_DCACHE
+
+// The cycle counter for copy_bench.c, timer 0 of the simulated machine
+#define XPAR_TMRCTR_0_BASEADDR SIM_TIMER_BASE
+#define XPAR_TMRCTR_0_CLOCK_FREQ_HZ SIM_TIMER_HZ
+
+#endif
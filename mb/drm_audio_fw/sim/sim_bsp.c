@@ -0,0 +1,279 @@
+/*
+ * Stand-ins for the Xilinx BSP calls the DRM makes, for running it under qemu-system-microblazeel.
+ * Console output goes to the machine's UART lite, and the GPIO interrupt from miPod is replaced by a
+ * doorbell word in shared DDR that a periodic timer interrupt polls. The DMA and FIFO count are
+ * instant and always full, so playback is limited by the DRM alone.
+ */
+#include <stdarg.h>
+#include "xparameters.h"
+#include "xil_io.h"
+#include "xil_mem.h"
+#include "xil_printf.h"
+#include "xil_exception.h"
+#include "xintc.h"
+#include "xaxidma.h"
+#include "xstatus.h"
+#include "mb_interface.h"
+#include "sleep.h"
+#include "PWM.h"
+#include "constants.h"
+
+// UART lite registers
+#define UART_TX         0x4
+#define UART_STATUS     0x8
+#define UART_TX_FULL    0x08
+
+// intc registers
+#define INTC_IER        0x08
+#define INTC_IAR        0x0C
+#define INTC_MER        0x1C
+
+// timer 1 registers and control bits
+#define TIMER_TCSR1     0x10
+#define TIMER_TLR1      0x14
+#define TCSR_UDT        0x002
+#define TCSR_ARHT       0x010
+#define TCSR_LOAD       0x020
+#define TCSR_ENIT       0x040
+#define TCSR_ENT        0x080
+#define TCSR_TINT       0x100
+#define POLL_TCSR       (TCSR_UDT | TCSR_ARHT | TCSR_ENIT | TCSR_ENT)
+
+// the top level handler, microblaze_register_handler or Xil_ExceptionRegisterHandler
+static XInterruptHandler top_handler;
+static void *top_data;
+
+// the device handler behind the intc, XIntc_Connect
+static XInterruptHandler device_handler;
+static void *device_data;
+
+// doorbell value last passed on to the DRM
+static u32 doorbell_seen;
+
+static XAxiDma_Config dma_config;
+
+
+//////////////////////// CONSOLE ////////////////////////
+
+void outbyte(char ch) {
+	while (Xil_In32(SIM_UART_BASE + UART_STATUS) & UART_TX_FULL) continue;
+	Xil_Out32(SIM_UART_BASE + UART_TX, (u32)ch);
+}
+
+static void out_num(u32 num, u32 base) {
+	char digits[10];
+	int n = 0;
+
+	do {
+		digits[n++] = "0123456789abcdef"[num % base];
+		num /= base;
+	} while (num);
+
+	while (n) {
+		outbyte(digits[--n]);
+	}
+}
+
+/*
+ * Prints the subset of xil_printf the DRM uses: %d %i %u %x %s %c %%
+ */
+void xil_printf(const char8 *ctrl1, ...) {
+	const char8 *fmt;
+	va_list ap;
+
+	va_start(ap, ctrl1);
+	for (fmt = ctrl1; *fmt; fmt++) {
+		if (*fmt != '%') {
+			outbyte(*fmt);
+			continue;
+		}
+
+		switch (*++fmt) {
+		case 'd':
+		case 'i': {
+			int num = va_arg(ap, int);
+			// negated unsigned, so INT_MIN does not overflow
+			u32 mag = num < 0 ? 0u - (u32)num : (u32)num;
+			if (num < 0) {
+				outbyte('-');
+			}
+			out_num(mag, 10);
+			break;
+		}
+		case 'u':
+			out_num(va_arg(ap, u32), 10);
+			break;
+		case 'x':
+			out_num(va_arg(ap, u32), 16);
+			break;
+		case 's': {
+			const char8 *str = va_arg(ap, const char8 *);
+			while (*str) {
+				outbyte(*str++);
+			}
+			break;
+		}
+		case 'c':
+			outbyte((char)va_arg(ap, int));
+			break;
+		case '\0':
+			va_end(ap);
+			return;
+		default:
+			outbyte(*fmt);
+			break;
+		}
+	}
+	va_end(ap);
+}
+
+
+//////////////////////// STANDALONE LIBRARY ////////////////////////
+
+/*
+ * Same loop as the standalone BSP's and placed with it in .text.hot, the baseline for copy_bench.c
+ */
+HOT_CODE void Xil_MemCpy(void* dst, const void* src, u32 cnt) {
+	char *d = (char *)dst;
+	const char *s = src;
+
+	while (cnt >= sizeof(int)) {
+		*(int *)d = *(const int *)s;
+		d += sizeof(int);
+		s += sizeof(int);
+		cnt -= sizeof(int);
+	}
+	while (cnt > 0U) {
+		*d++ = *s++;
+		cnt--;
+	}
+}
+
+int usleep(unsigned long useconds) {
+	volatile unsigned long i;
+
+	// roughly four instructions a loop
+	for (i = 0; i < useconds * (SIM_TIMER_HZ / 1000000) / 4; i++) continue;
+	return 0;
+}
+
+
+//////////////////////// INTERRUPTS ////////////////////////
+
+void microblaze_register_handler(XInterruptHandler Handler, void *DataPtr) {
+	top_handler = Handler;
+	top_data = DataPtr;
+}
+
+void microblaze_enable_interrupts(void) {
+	u32 msr;
+
+	// set MSR[IE] without msrset, the design leaves the MSR instructions out
+	__asm__ __volatile__ ("mfs %0, rmsr" : "=r" (msr));
+	msr |= 0x2;
+	__asm__ __volatile__ ("mts rmsr, %0" :: "r" (msr) : "memory");
+}
+
+void Xil_ExceptionInit(void) {
+}
+
+void Xil_ExceptionRegisterHandler(u32 Id, Xil_ExceptionHandler Handler, void *Data) {
+	if (Id == XIL_EXCEPTION_ID_INT) {
+		microblaze_register_handler((XInterruptHandler)Handler, Data);
+	}
+}
+
+/*
+ * Starts polling the doorbell: timer 1 interrupts every SIM_POLL_TICKS through the intc
+ */
+void Xil_ExceptionEnable(void) {
+	doorbell_seen = Xil_In32(SIM_DOORBELL);
+
+	Xil_Out32(SIM_TIMER_BASE + TIMER_TLR1, SIM_POLL_TICKS);
+	Xil_Out32(SIM_TIMER_BASE + TIMER_TCSR1, TCSR_LOAD);
+	Xil_Out32(SIM_TIMER_BASE + TIMER_TCSR1, POLL_TCSR);
+
+	Xil_Out32(SIM_INTC_BASE + INTC_IER, 1 << SIM_TIMER_IRQ);
+	Xil_Out32(SIM_INTC_BASE + INTC_MER, 0x3);
+
+	microblaze_enable_interrupts();
+}
+
+int XIntc_Initialize(XIntc * InstancePtr, u16 DeviceId) {
+	return XST_SUCCESS;
+}
+
+int XIntc_Connect(XIntc * InstancePtr, u8 Id, XInterruptHandler Handler, void *CallBackRef) {
+	device_handler = Handler;
+	device_data = CallBackRef;
+	return XST_SUCCESS;
+}
+
+int XIntc_Start(XIntc * InstancePtr, u8 Mode) {
+	return XST_SUCCESS;
+}
+
+void XIntc_Enable(XIntc * InstancePtr, u8 Id) {
+}
+
+void XIntc_InterruptHandler(XIntc * InstancePtr) {
+	if (device_handler) {
+		device_handler(device_data);
+	}
+}
+
+/*
+ * The MicroBlaze interrupt vector. Acknowledges the poll tick and raises the DRM's interrupt
+ * when miPod has rung the doorbell since the last one.
+ */
+void __attribute__((interrupt_handler)) _interrupt_handler(void) {
+	u32 bell;
+
+	Xil_Out32(SIM_TIMER_BASE + TIMER_TCSR1, POLL_TCSR | TCSR_TINT);
+	Xil_Out32(SIM_INTC_BASE + INTC_IAR, 1 << SIM_TIMER_IRQ);
+
+	bell = Xil_In32(SIM_DOORBELL);
+	if (bell != doorbell_seen) {
+		doorbell_seen = bell;
+		if (top_handler) {
+			top_handler(top_data);
+		}
+	}
+}
+
+
+//////////////////////// AUDIO ////////////////////////
+
+XAxiDma_Config *XAxiDma_LookupConfig(u32 DeviceId) {
+	dma_config.DeviceId = DeviceId;
+	return &dma_config;
+}
+
+int XAxiDma_CfgInitialize(XAxiDma * InstancePtr, XAxiDma_Config *Config) {
+	InstancePtr->HasSg = 0;
+	InstancePtr->Initialized = 1;
+
+	// the simulated FIFO never drains
+	Xil_Out32(XPAR_FIFO_COUNT_AXI_GPIO_0_BASEADDR, FIFO_CAP);
+	return XST_SUCCESS;
+}
+
+HOT_CODE u32 XAxiDma_SimpleTransfer(XAxiDma *InstancePtr, UINTPTR BuffAddr, u32 Length, int Direction) {
+	return XST_SUCCESS;
+}
+
+HOT_CODE u32 XAxiDma_Busy(XAxiDma *InstancePtr, int Direction) {
+	return FALSE;
+}
+
+void PWM_Enable(u32 baseAddr) {
+	PWM_mWriteReg(baseAddr, PWM_AXI_CTRL_REG_OFFSET, 1);
+}
+
+void PWM_Set_Period(u32 baseAddr, u32 clocks) {
+	PWM_mWriteReg(baseAddr, PWM_AXI_PERIOD_REG_OFFSET, clocks);
+}
+
+void PWM_Set_Duty(u32 baseAddr, u32 clocks, u32 pwmIndex) {
+	PWM_mWriteReg(baseAddr, PWM_AXI_DUTY_REG_OFFSET + (pwmIndex * 4), clocks);
+}
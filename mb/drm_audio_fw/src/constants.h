@@ -3,13 +3,31 @@
 
 #include "xil_printf.h"
 
-// shared DDR address
+// shared DDR address, the simulator build (see sim/) moves it
+#ifndef SHARED_DDR_BASE
 #define SHARED_DDR_BASE (0x20000000 + 0x1CC00000)
+#endif
+
+// code and data placement, see lscript.ld
+// hot code is what runs for every chunk while a song plays, cold code runs once per command or on errors
+#define HOT_CODE __attribute__((section(".text.hot")))
+#define COLD_CODE __attribute__((section(".cold_text"), cold))
+#define HOT_DATA __attribute__((section(".bss.hot")))
 
 // memory constants
 #define CHUNK_SZ 16000
 #define FIFO_CAP 4096*4
 
+// underrun handling while waiting on miPod to refill the song buffer
+#define UNDERRUN_LOW_WATER 1024         // FIFO fill that triggers an urgent refill request
+#define SILENCE_OFFSET (2 * CHUNK_SZ)   // zeroed DMA BRAM past the two audio slices
+#define SILENCE_SZ 512                  // bytes of silence queued per starved DMA slot
+
+// Set to 0 to let the FIFO drain instead of padding it with silence
+#ifndef UNDERRUN_FILL_SILENCE
+#define UNDERRUN_FILL_SILENCE 1
+#endif
+
 // number of seconds to record/playback
 #define PREVIEW_TIME_SEC 30
 
@@ -22,18 +40,34 @@
 #define MB_PROMPT "\r\nMB> "
 #define mb_printf(...) xil_printf(MB_PROMPT __VA_ARGS__)
 
+// log levels, lower is more severe
+#define LOG_ERROR 0
+#define LOG_WARN 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+
+// log ring constants (size must be a power of two)
+#define LOG_RING_SZ 4096
+#define LOG_MSG_SZ 120
+#define log_pos(n) ((n) & (LOG_RING_SZ - 1))
+
 // protocol constants
-#define MAX_REGIONS 32
+#define MAX_REGIONS 64                  // regions and users of a deployment, the bits of compact metadata
 #define REGION_NAME_SZ 16
-#define MAX_USERS 64
+#define MAX_USERS 2048
 #define USERNAME_SZ 16
+#define QUERY_PAGE_USERS 64             // user names returned by one query, miPod pages through the rest
 #define MAX_PIN_SZ 8
 #define MAX_SONG_SZ (1<<25)
 
-#define HASHPIN_SZ 65
-#define SALT_SZ 7
+// id lists of a purdue_md
+#define PURDUE_MD_REGIONS 32
+#define PURDUE_MD_USERS 64
+
+#define SALT_LEN 6                      // hex characters, hashed after the pin
 
 #define SHA_256_SUM_SZ 32
+#define KEY_SZ 32                       // device key, DEVICE_KEY in secrets.h
 
 #define NONCE_SIZE 12
 #define WAVE_HEADER_SZ 44
@@ -41,16 +75,35 @@
 #define META_DATA_ALLOC 4
 #define ENC_WAVE_HEADER_SZ WAVE_HEADER_SZ + META_DATA_ALLOC
 #define MAC_SIZE 16
-#define SONG_CHUNK_SZ 16000
+#define SONG_CHUNK_SZ 16000             // v1 chunk size and the largest chunk a v2 song may use
+#define MIN_CHUNK_SZ 1024               // smallest v2 chunk size, keeps a refill worth of audio buffered
 #define ENC_BUFFER_SZ 60
 #define ENC_CHUNK_SZ SONG_CHUNK_SZ + MAC_SIZE
 
+// protected song format, v2 files start with a plaintext prefix, v1 files with the header nonce
+#define DRM_MAGIC "DRMSONG"
+#define DRM_MAGIC_SZ 8
+#define DRM_FORMAT_V1 1
+#define DRM_FORMAT_V2 2
+
+// v2 prefix flags
+#define SONG_FLAG_COUNTER_NONCES (1 << 0)   // chunk nonce is a song prefix and the chunk number, which the aad binds
+#define SONG_FLAG_MERKLE_ROOT (1 << 1)      // header carries a merkle root over every chunk tag
+#define SONG_FLAG_COMPACT_METADATA (1 << 2) // metadata is a compact_md rather than a purdue_md
+#define SONG_FLAG_HEADER_HASH (1 << 3)      // header carries the song hash and nonce prefix, the prefix is the chunk aad
+#define SONG_KNOWN_FLAGS (SONG_FLAG_COUNTER_NONCES | SONG_FLAG_MERKLE_ROOT | SONG_FLAG_COMPACT_METADATA | SONG_FLAG_HEADER_HASH)
+#define SONG_HEADER_HASH_NEEDS (SONG_FLAG_COUNTER_NONCES | SONG_FLAG_MERKLE_ROOT)
+#define NONCE_PREFIX_SZ 8
+
+// command queue constants (must be a power of two)
+#define CMD_QUEUE_SZ 16
+#define queue_slot(n) ((n) & (CMD_QUEUE_SZ - 1))
+
 // structs to import secrets.h JSON data into memory
+// users and regions are listed in secrets file order, so an index is also the entry's bit in compact metadata
 typedef struct {
     u32 uid;
     char username[USERNAME_SZ];
-    char hashedPin[HASHPIN_SZ];
-    char salt[SALT_SZ];
 } user_struct;
 
 typedef struct {
@@ -58,13 +111,12 @@ typedef struct {
     char regionName[REGION_NAME_SZ];
 } region_struct;
 
+// login secrets of a provisioned user, device_logins is sorted by user
 typedef struct {
-    u32 provisioned_userID;
-} provisioned_user_struct;
-
-typedef struct {
-    u32 provisioned_regionID;
-} provisioned_region_struct;
+    u16 user;                           // index into device_users
+    char salt[SALT_LEN];
+    u8 hashed_pin[SHA_256_SUM_SZ];      // sha256 of the pin followed by the salt
+} login_struct;
 
 // LED colors and controller
 struct color {
@@ -75,14 +127,24 @@ struct color {
 
 
 // struct to interpret shared buffer as a query
+// users holds one page of the user names, starting at the query offset miPod asked for
 typedef struct {
     u32 num_regions;
-    u32 num_users;
+    u32 num_users;              // users of the player or song, over all pages
+    u32 page_users;             // user names in this page
     char owner[USERNAME_SZ];
     char regions[MAX_REGIONS * REGION_NAME_SZ];
-    char users[MAX_USERS * USERNAME_SZ];
+    char users[QUERY_PAGE_USERS * USERNAME_SZ];
 } query;
 
+// counts and owner at the start of a query, published once the names are in place
+typedef struct {
+    u32 num_regions;
+    u32 num_users;
+    u32 page_users;
+    char owner[USERNAME_SZ];
+} query_head;
+
 // simulate array of 64B names without pointer indirection
 #define q_region_lookup(q, i) (q.regions + (i * REGION_NAME_SZ))
 #define q_user_lookup(q, i) (q.users + (i * USERNAME_SZ))
@@ -93,10 +155,30 @@ typedef struct __attribute__ ((__packed__)) {
     u32 owner_id;
     u8 num_regions;
     u8 num_users;
-    u32 provisioned_regions[MAX_REGIONS];
-    u32 provisioned_users[MAX_USERS];
+    u32 provisioned_regions[PURDUE_MD_REGIONS];
+    u32 provisioned_users[PURDUE_MD_USERS];
 } purdue_md;
 
+// compact metadata, bit i of a bitmap is entry i of the global region or user list
+#define PURDUE_MD_VERSION 1
+#define COMPACT_MD_VERSION 2
+#define REGION_WORDS (MAX_REGIONS / 32)
+#define USER_WORDS (MAX_USERS / 32)
+
+// word aligned so the bitmaps can be read a word at a time, the size is already a whole number of words
+typedef struct __attribute__ ((__packed__, __aligned__(4))) {
+	unsigned char sha256sum[SHA_256_SUM_SZ];
+    u8 md_version;              // COMPACT_MD_VERSION, PURDUE_MD_VERSION once a purdue_md is decoded into one
+    u8 reserved[3];
+    u32 owner_id;
+    u32 region_bits[REGION_WORDS];  // regions the song plays in
+    u32 user_bits[USER_WORDS];      // users the song is shared with
+} compact_md;
+
+#define COMPACT_MD_SZ sizeof(compact_md)
+#define has_bit(bits, i) ((bits)[(i) / 32] & (1u << ((i) % 32)))
+#define set_bit(bits, i) ((bits)[(i) / 32] |= (1u << ((i) % 32)))
+
 typedef struct __attribute__ ((__packed__)) {
     char packing1[4];
     u32 file_size;
@@ -115,6 +197,37 @@ typedef struct __attribute__ ((__packed__)) {
 	unsigned char tag[MAC_SIZE];
 } encryptedWaveheader;
 
+// plaintext start of a v2 song, authenticated as part of the header aad
+typedef struct __attribute__ ((__packed__)) {
+	char magic[DRM_MAGIC_SZ];
+	u32 version;
+	u32 flags;
+} songPrefix;
+
+// v2 header, v1 headers are read into the same struct with the fixed layout filled in
+typedef struct __attribute__ ((__packed__)) {
+	waveHeaderStruct wave_header;
+	u32 metadata_size;
+	u32 chunk_size;
+	u32 num_chunks;             // full chunks plus the remainder chunk
+	u32 index_offset;           // file offset of the chunk index, 0 for v1
+	unsigned char merkle_root[SHA_256_SUM_SZ];  // only present with SONG_FLAG_MERKLE_ROOT
+	unsigned char sha256sum[SHA_256_SUM_SZ];    // only present with SONG_FLAG_HEADER_HASH, which needs the merkle root
+	u8 nonce_prefix[NONCE_PREFIX_SZ];
+} songHeaderStruct;
+
+// encrypted length of a v2 header, the tag follows directly after it
+#define SONG_HEADER_SZ(flags) (sizeof(songHeaderStruct) \
+		- ((flags) & SONG_FLAG_HEADER_HASH ? 0 : SHA_256_SUM_SZ + NONCE_PREFIX_SZ) \
+		- ((flags) & SONG_FLAG_MERKLE_ROOT ? 0 : SHA_256_SUM_SZ))
+
+typedef struct __attribute__ ((__packed__)) {
+	songPrefix prefix;
+	unsigned char nonce[NONCE_SIZE];
+	songHeaderStruct header;
+	unsigned char tag[MAC_SIZE];    // sits in place of the fields a song has no flag for
+} encryptedSongHeader;
+
 typedef struct __attribute__ ((__packed__)) {
 	unsigned char nonce[NONCE_SIZE];
 	unsigned char tag[MAC_SIZE];
@@ -131,11 +244,63 @@ typedef struct __attribute__ ((__packed__)) {
 
 #define get_chunk_data(c) ((unsigned char *)(&c.data))
 
+// playback counters, published into the command channel on a STATS command
+typedef struct __attribute__ ((__packed__)) {
+    u32 chunks_verified;        // chunks that passed their Poly1305 check
+    u32 dma_waits;              // copies that had to wait for the DMA to go idle
+    u32 fifo_low_water;         // lowest FIFO fill level seen while playing
+    u32 refill_waits;           // chunk refills requested from miPod
+    u32 underruns;              // times the FIFO was found empty while playing
+    u32 silence_frames;         // silence slices queued to ride out a late refill
+    u32 md_cache_hits;          // metadata records answered from the verified cache
+    u32 md_cache_misses;        // metadata records that went through the AEAD
+    u32 idle_sleeps;            // times the core slept waiting for an interrupt
+    u64 idle_spins;             // polling loop iterations while waiting, the idle power proxy
+    u32 wakeups;                // interrupt wakes of a waiting loop
+    u32 state_changes;          // DRM state transitions published to miPod
+    u32 led_updates;            // LED colors written to the PWM
+} telemetry;
+
+// DRM log messages waiting for miPod, each stored as level, length and text
+// counters are free running byte offsets and wrap through log_pos()
+typedef struct __attribute__ ((__packed__)) {
+    u32 head;                   // next byte the DRM will write
+    u32 tail;                   // next byte miPod will read
+    u32 dropped;                // messages lost because the ring was full
+    char buf[LOG_RING_SZ];
+} log_ring;
+
+// single operation of a batched command submission
+typedef struct __attribute__ ((__packed__)) {
+    u8 opcode;                  // from commands enum
+    u8 status;                  // from queue_states enum
+    u16 seq;                    // submission number, echoed back by the DRM
+    u32 result;                 // command specific result
+    u32 query_offset;           // first user name a query returns
+    char username[USERNAME_SZ]; // login username or share target
+    char pin[MAX_PIN_SZ];       // login pin
+    query query;                // query results, one page of users
+    encryptedMetadata metadata; // song metadata for query/share
+    u16 metadata_size;          // plaintext size of metadata, METADATA_SZ or COMPACT_MD_SZ
+} cmd_queue_entry;
+
+// submission/completion queue pair, drained by the DRM on each BATCH command
+// counters are free running and wrap through queue_slot()
+typedef struct __attribute__ ((__packed__)) {
+    u32 sq_head;                // next submission the DRM will consume
+    u32 sq_tail;                // next submission miPod will write
+    u32 cq_head;                // next completion miPod will consume
+    u32 cq_tail;                // next completion the DRM will write
+    u8 cq[CMD_QUEUE_SZ];        // completed entry slots, in completion order
+    cmd_queue_entry entries[CMD_QUEUE_SZ];
+} cmd_queue;
+
 // TODO: remove deprecated commands
 // shared buffer values
-enum commands { QUERY_PLAYER, QUERY_SONG, LOGIN, LOGOUT, SHARE, PLAY, STOP, DIGITAL_OUT, PAUSE, RESTART, FF, RW, PLAY_SONG, READ_HEADER, READ_METADATA, WAIT_FOR_CHUNK, READ_CHUNK, ENC_SHARE, QUERY_ENC_SONG };
+enum commands { QUERY_PLAYER, QUERY_SONG, LOGIN, LOGOUT, SHARE, PLAY, STOP, DIGITAL_OUT, PAUSE, RESTART, FF, RW, PLAY_SONG, READ_HEADER, READ_METADATA, WAIT_FOR_CHUNK, READ_CHUNK, ENC_SHARE, QUERY_ENC_SONG, BATCH, STATS };
 enum states   { STOPPED, WORKING, PLAYING, PAUSED, WAITING_FILE_HEADER, WAITING_METADATA, WAITING_CHUNK, READING_CHUNK };
 enum play_states {DECRYPT, DECRYPT_TEMP, COPY, COPY_TEMP, REQUEST};
+enum queue_states { QUEUE_EMPTY, QUEUE_SUBMITTED, QUEUE_DONE, QUEUE_FAILED };
 
 
 // struct to interpret shared command channel
@@ -152,7 +317,16 @@ typedef volatile struct __attribute__((__packed__)) {
     u32 chunk_nums;
     u32 chunk_remainder;
     u32 buffer_offset;
+    u32 refill_request;         // refills requested by the DRM, free running
+    u32 refill_complete;        // last refill miPod finished
+    u32 refill_progress;        // chunks of the current refill already in songBuffer
+    u32 refill_urgent;          // set while the audio FIFO is starving for the refill
+    u32 index_offset;           // file offset of the chunk index of a v2 song, 0 for v1
+    u32 query_offset;           // first user name a query returns, outside the union as it overlaps the metadata
     waveHeaderStruct wave_header;
+    telemetry stats;            // DRM counters, valid after a STATS command
+    log_ring log;               // DRM log messages, drained by miPod
+    cmd_queue queue;            // batched commands, outside the union so other commands leave its counters alone
     unsigned char songBuffer[ENC_BUFFER_SZ * SONG_CHUNK_SZ];
 
     // shared buffer is either a drm song or a query
@@ -162,6 +336,7 @@ typedef volatile struct __attribute__((__packed__)) {
 
         // Encrypted
         encryptedWaveheader encWaveHeaderMeta;
+        encryptedSongHeader encSongHeader;
         encryptedMetadata encMetadata;
         encryptedSongChunk encSongChunk;
         encryptedSongChunk encSongBuffer[ENC_BUFFER_SZ];
@@ -171,26 +346,17 @@ typedef volatile struct __attribute__((__packed__)) {
 } cmd_channel;
 
 
-// local store for drm metadata
-typedef struct {
-    u8 md_size;
-    u8 owner_id;
-    u8 num_regions;
-    u8 rids[MAX_REGIONS];
-    u8 num_users;
-    u8 uids[MAX_USERS];
-} song_md;
-
-
 // store of internal state
 typedef struct {
+    compact_md song_auth;       // authorization of the current song, decoded from either format
     char logged_in;             // whether or not a user is logged on
     u32 uid;                     // logged on user id
     char username[USERNAME_SZ]; // logged on username
     char pin[MAX_PIN_SZ];       // logged on pin
-    song_md song_md;            // current song metadata
-    purdue_md purdue_md;
+    purdue_md purdue_md;        // metadata of the current song when it is not compact
     u32 total_bytes_to_play;	// Total number of bytes in a song
+    u32 song_flags;             // v2 prefix flags of the current song, 0 for v1
+    u8 nonce_prefix[NONCE_PREFIX_SZ];   // chunk aad of a SONG_FLAG_HEADER_HASH song, from its header
     char drm_state;				// drm state
     u8 buffer_offset;
     char play_state;			// Keeps track of the playing state
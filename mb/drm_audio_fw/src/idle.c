@@ -0,0 +1,174 @@
+#include "idle.h"
+#include "constants.h"
+#include "telemetry.h"
+
+/*
+ * Idle scheduler
+ *
+ * Interrupts raise wake reasons with idle_notify, the main loop sleeps in
+ * idle_wait until one it cares about is pending and consumes them with
+ * idle_take. Each reason is a pair of counters: raised[] is only written in
+ * interrupt context and taken[] only by the main loop, so neither needs
+ * interrupts masked. Reasons raised several times before they are taken
+ * count once, as the old InterruptProcessed flag did.
+ *
+ * Reasons with a poll function have no interrupt behind them. They are
+ * pending while the function returns true, and waiting on one spins.
+ */
+
+static volatile u32 raised[WAKE_SOURCES];
+static u32 taken[WAKE_SOURCES];
+static idle_poll_fn polls[WAKE_SOURCES];
+
+// moves on every idle_notify, idle_sleep only sleeps while it stands still
+static volatile u32 wake_seq;
+
+COLD_CODE void idle_set_poll(u32 reason, idle_poll_fn ready) {
+	u32 bit = 1;
+
+	for (int i = 0; i < WAKE_SOURCES; i++, bit <<= 1) {
+		if (reason & bit) {
+			polls[i] = ready;
+		}
+	}
+}
+
+/*
+ * Raises wake reasons, called from interrupt context
+ */
+HOT_CODE void idle_notify(u32 reason) {
+	u32 bit = 1;
+
+	for (int i = 0; i < WAKE_SOURCES; i++, bit <<= 1) {
+		if (reason & bit) {
+			raised[i]++;
+		}
+	}
+	wake_seq++;
+
+	idle_fixup_return();
+}
+
+// reasons in mask that are pending, consuming them if take is set
+static HOT_CODE u32 pending(u32 mask, int take) {
+	u32 woke = 0;
+	u32 bit = 1;
+
+	// variable shifts are a loop without the barrel shifter, so walk the bit along
+	for (int i = 0; i < WAKE_SOURCES; i++, bit <<= 1) {
+		if (!(mask & bit)) {
+			continue;
+		}
+
+		if (polls[i]) {
+			if (polls[i]()) {
+				woke |= bit;
+			}
+		} else {
+			u32 r = raised[i];
+			if (r != taken[i]) {
+				if (take) {
+					taken[i] = r;
+				}
+				woke |= bit;
+			}
+		}
+	}
+
+	return woke;
+}
+
+/*
+ * Returns and consumes the reasons in mask that are pending, without waiting
+ */
+HOT_CODE u32 idle_take(u32 mask) {
+	return pending(mask, TRUE);
+}
+
+/*
+ * Waits until a reason in mask is pending and returns them, without consuming them
+ * Sleeps between interrupts unless a polled reason is in mask
+ */
+HOT_CODE u32 idle_wait(u32 mask) {
+	int waited = FALSE;
+	u32 polled = 0;
+	u32 bit = 1;
+	u32 woke, seq;
+
+	for (int i = 0; i < WAKE_SOURCES; i++, bit <<= 1) {
+		if (polls[i]) {
+			polled |= bit;
+		}
+	}
+
+	while (1) {
+		// read before checking, so a wake after the check stops the sleep below
+		seq = wake_seq;
+
+		woke = pending(mask, FALSE);
+		if (woke) {
+			break;
+		}
+
+		waited = TRUE;
+		if (!IDLE_SLEEP || (mask & polled)) {
+			tm_count(idle_spins);
+			continue;
+		}
+
+		tm_count(idle_sleeps);
+		idle_sleep(&wake_seq, seq);
+	}
+
+#if TELEMETRY
+	// waits ended by an interrupt rather than a poll
+	if (waited && (woke & ~polled)) {
+		tm_count(wakeups);
+	}
+#else
+	(void) waited;
+#endif
+	return woke;
+}
+
+// __microblaze__ comes from the compiler itself, host builds define __MICROBLAZE__ for the BSP headers
+#ifdef __microblaze__
+/*
+ * mbar 16 puts the core to sleep until the next interrupt. An interrupt taken
+ * after wake_seq was loaded but before the mbar would leave the core asleep
+ * with the wake already posted, so idle_fixup_return moves the return address
+ * of any interrupt landing in that window past the mbar.
+ */
+__asm__ (
+	"	.section .text.hot,\"ax\",@progbits\n"
+	"	.align	2\n"
+	"	.globl	idle_sleep\n"
+	"	.type	idle_sleep, @function\n"
+	"idle_sleep:\n"
+	"idle_window_start:\n"
+	"	lwi	r3, r5, 0\n"
+	"	xor	r3, r3, r6\n"
+	"	bnei	r3, idle_window_end\n"
+	"	mbar	16\n"
+	"idle_window_end:\n"
+	"	rtsd	r15, 8\n"
+	"	nop\n"
+	"	.size	idle_sleep, . - idle_sleep\n"
+	"	.previous\n"
+);
+
+extern char idle_window_start[], idle_window_end[];
+
+/*
+ * r14 holds the interrupted address until the handler returns with rtid, and
+ * the compiler never allocates it or saves it in interrupt handlers
+ */
+HOT_CODE void idle_fixup_return(void) {
+	u32 pc;
+
+	__asm__ __volatile__ ("addk %0, r14, r0" : "=r" (pc));
+	if (pc >= (u32) idle_window_start && pc < (u32) idle_window_end) {
+		__asm__ __volatile__ ("addk r14, %0, r0" :: "r" ((u32) idle_window_end));
+	}
+}
+#endif
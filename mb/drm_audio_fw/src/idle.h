@@ -0,0 +1,29 @@
+#ifndef IDLE_H
+#define IDLE_H
+#include "xil_types.h"
+
+// Set to 0 to spin between interrupts instead of sleeping
+#ifndef IDLE_SLEEP
+#define IDLE_SLEEP 1
+#endif
+
+// Wake reasons, one bit each
+// WAKE_CMD is raised by the command interrupt from miPod. The design routes no DMA
+// interrupt to the intc, so WAKE_DMA is polled through the function set with idle_set_poll.
+#define WAKE_CMD        0x1
+#define WAKE_DMA        0x2
+#define WAKE_SOURCES    2
+
+typedef int (*idle_poll_fn)(void);
+
+void idle_set_poll(u32 reason, idle_poll_fn ready);
+void idle_notify(u32 reason);
+u32 idle_take(u32 mask);
+u32 idle_wait(u32 mask);
+
+// Sleeps until the next interrupt, unless *seq has already moved on from seen
+void idle_sleep(const volatile u32 *seq, u32 seen);
+// Called from interrupt context so an interrupt just before the sleep cannot be slept through
+void idle_fixup_return(void);
+
+#endif
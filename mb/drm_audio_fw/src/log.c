@@ -0,0 +1,116 @@
+#include <stdarg.h>
+#include "log.h"
+#include "shm.h"
+
+// shared command channel between microblaze and linux
+extern volatile cmd_channel *c;
+
+// appends a character to a message, dropping anything past LOG_MSG_SZ
+static void put_char(char *msg, u32 *len, char ch) {
+	if (*len < LOG_MSG_SZ) {
+		msg[(*len)++] = ch;
+	}
+}
+
+static void put_num(char *msg, u32 *len, u32 num, u32 base) {
+	char digits[10];
+	int n = 0;
+
+	do {
+		digits[n++] = "0123456789abcdef"[num % base];
+		num /= base;
+	} while (num);
+
+	while (n) {
+		put_char(msg, len, digits[--n]);
+	}
+}
+
+/*
+ * Formats the subset of xil_printf the DRM uses: %d %i %u %x %s %c %%
+ */
+static u32 log_format(char *msg, const char *fmt, va_list ap) {
+	u32 len = 0;
+
+	for (; *fmt; fmt++) {
+		if (*fmt != '%') {
+			put_char(msg, &len, *fmt);
+			continue;
+		}
+
+		switch (*++fmt) {
+		case 'd':
+		case 'i': {
+			int num = va_arg(ap, int);
+			// negated unsigned, so INT_MIN does not overflow
+			u32 mag = num < 0 ? 0u - (u32)num : (u32)num;
+			if (num < 0) {
+				put_char(msg, &len, '-');
+			}
+			put_num(msg, &len, mag, 10);
+			break;
+		}
+		case 'u':
+			put_num(msg, &len, va_arg(ap, u32), 10);
+			break;
+		case 'x':
+			put_num(msg, &len, va_arg(ap, u32), 16);
+			break;
+		case 's': {
+			const char *str = va_arg(ap, const char *);
+			while (*str) {
+				put_char(msg, &len, *str++);
+			}
+			break;
+		}
+		case 'c':
+			put_char(msg, &len, (char)va_arg(ap, int));
+			break;
+		case '\0':
+			return len;
+		default:
+			put_char(msg, &len, *fmt);
+			break;
+		}
+	}
+
+	return len;
+}
+
+/*
+ * Formats a message into the log ring, dropping it if miPod has fallen behind
+ */
+void log_write(u8 level, const char *fmt, ...) {
+	volatile log_ring *ring = &c->log;
+	u8 rec[2 + LOG_MSG_SZ + 1];
+	va_list ap;
+
+	va_start(ap, fmt);
+	u32 len = log_format((char *)rec + 2, fmt, ap);
+	va_end(ap);
+
+	rec[0] = level;
+	rec[1] = len;
+
+#if LOG_UART
+	rec[2 + len] = '\0';
+	mb_printf("%s", rec + 2);
+#endif
+
+	u32 head = ring->head;
+	u32 size = len + 2;
+
+	if (LOG_RING_SZ - (head - ring->tail) < size) {
+		ring->dropped++;
+		return;
+	}
+
+	// copy the record in, in two pieces if it wraps around the end of the ring
+	u32 pos = log_pos(head);
+	u32 first = (LOG_RING_SZ - pos < size) ? LOG_RING_SZ - pos : size;
+
+	shm_commit(&ring->buf[pos], rec, first);
+	shm_commit(ring->buf, rec + first, size - first);
+
+	ring->head = head + size;
+}
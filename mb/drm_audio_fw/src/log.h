@@ -0,0 +1,46 @@
+#ifndef LOG_H
+#define LOG_H
+#include "constants.h"
+
+/*
+ * Deferred logging: messages are formatted into the log ring in the command
+ * channel and printed by miPod, so logging never waits on the UART
+ */
+
+// Messages less severe than this are compiled out
+#ifndef LOG_LEVEL
+#define LOG_LEVEL LOG_INFO
+#endif
+
+// Set to 1 to also echo every message over the UART (blocks on each one)
+#ifndef LOG_UART
+#define LOG_UART 0
+#endif
+
+void log_write(u8 level, const char *fmt, ...);
+
+#if LOG_LEVEL >= LOG_ERROR
+#define log_error(...) log_write(LOG_ERROR, __VA_ARGS__)
+#else
+#define log_error(...)
+#endif
+
+#if LOG_LEVEL >= LOG_WARN
+#define log_warn(...) log_write(LOG_WARN, __VA_ARGS__)
+#else
+#define log_warn(...)
+#endif
+
+#if LOG_LEVEL >= LOG_INFO
+#define log_info(...) log_write(LOG_INFO, __VA_ARGS__)
+#else
+#define log_info(...)
+#endif
+
+#if LOG_LEVEL >= LOG_DEBUG
+#define log_debug(...) log_write(LOG_DEBUG, __VA_ARGS__)
+#else
+#define log_debug(...)
+#endif
+
+#endif
@@ -6,6 +6,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stddef.h>
 #include "platform.h"
 #include "xparameters.h"
 #include "xil_exception.h"
@@ -13,10 +14,17 @@
 #include "xaxidma.h"
 #include "xil_mem.h"
 #include "util.h"
+#include "phash.h"
 #include "secrets.h"
 #include "xintc.h"
 #include "constants.h"
 #include "sleep.h"
+#include "telemetry.h"
+#include "shm.h"
+#include "log.h"
+#include "merkle.h"
+#include "md_cache.h"
+#include "idle.h"
 
 // Bearssl Library
 #include <bearssl_hash.h>
@@ -36,8 +44,7 @@ const struct color YELLOW = {0x01ff, 0x01ff, 0x0000};
 const struct color GREEN =  {0x0000, 0x01ff, 0x0000};
 const struct color BLUE =   {0x0000, 0x0000, 0x01ff};
 
-// DRM States and Colors associated with them
-#define change_state(state, color) c->drm_state = state; s.drm_state = state; setLED(led, color);
+// DRM States and Colors associated with them, see change_state
 #define set_stopped() change_state(STOPPED, RED)
 #define set_working() change_state(WORKING, YELLOW)
 #define set_playing() change_state(PLAYING, GREEN)
@@ -53,43 +60,153 @@ volatile cmd_channel *c = (cmd_channel*)SHARED_DDR_BASE;
 // internal state store
 static internal_state s;
 
+// LED color on the PWM and the one the current state asks for
+static struct color led_shown, led_wanted;
+
+// Publishes a DRM state to miPod, writing nothing when the state does not change
+// The LED is only queued, flush_led writes it when the DRM gets to it
+static HOT_CODE void change_state(char state, struct color color) {
+	if (state == s.drm_state) {
+		return;
+	}
+
+	c->drm_state = state;
+	s.drm_state = state;
+	led_wanted = color;
+	tm_count(state_changes);
+}
+
+// Writes a queued LED color, called between chunks and before waiting for a command
+static HOT_CODE void flush_led(void) {
+	if (led_wanted.r == led_shown.r && led_wanted.g == led_shown.g && led_wanted.b == led_shown.b) {
+		return;
+	}
+
+	setLED(led, led_wanted);
+	led_shown = led_wanted;
+	tm_count(led_updates);
+}
+
+// Shows the current state and sleeps until miPod sends a command
+static HOT_CODE void wait_for_command(void) {
+	flush_led();
+	idle_wait(WAKE_CMD);
+}
+
 // Large chunk buffer
-static unsigned char chunk_buffer[SONG_CHUNK_SZ];
+static unsigned char chunk_buffer[SONG_CHUNK_SZ] HOT_DATA;
+
+// Local copies of shared structs, filled and flushed through shm.h
+static encryptedMetadata enc_metadata_buffer;
+
+// aad of the two metadata formats, told apart by their size
+static const char purdue_md_aad[] = "meta_data";
+static const char compact_md_aad[] = "compact_md";
+
+// merkle root of the chunk tags played so far, checked against the header root at the end of a song
+static merkle_tree song_tree HOT_DATA;
+
+// bounds of the hot and cold code, set by lscript.ld
+extern char __text_hot_start[], __text_hot_end[], __text_cold_start[], __text_cold_end[];
 
 //////////////////////// INTERRUPT HANDLING ////////////////////////
 
-// shared variable between main thread and interrupt processing thread
-volatile static int InterruptProcessed = FALSE;
 static XIntc InterruptController;
 
-void myISR(void) {
-    InterruptProcessed = TRUE;
+// miPod has posted a command, wake whatever is waiting on one
+HOT_CODE void myISR(void) {
+    idle_notify(WAKE_CMD);
+}
+
+// The audio DMA can take the next slice once it is idle or the FIFO is close to full
+static HOT_CODE int dma_ready(void) {
+    return !XAxiDma_Busy(&sAxiDma, XAXIDMA_DMA_TO_DEVICE)
+            || *(u32 *) XPAR_FIFO_COUNT_AXI_GPIO_0_BASEADDR >= (FIFO_CAP - 32);
 }
 
 
 //////////////////////// UTILITY FUNCTIONS ////////////////////////
 
-// returns whether an rid has been provisioned
-int is_provisioned_rid(u32 rid) {
-    for (int i = 0; i < NUM_PROVISIONED_REGIONS; i++) {
-        if (rid == provisioned_rid[i].provisioned_regionID) {
-            return TRUE;
+// Lookups go through the perfect hash tables in secrets.h and confirm the one candidate they land on
+// Provisioned regions are set in provisioned_region_bits, provisioned users have an entry in device_logins
+
+// index of the region with this rid in device_regions, -1 if the device has none
+static int region_index(u32 rid) {
+    int i = ph_lookup(&rid_table, rid);
+    return (i >= 0 && device_regions[i].regionID == rid) ? i : -1;
+}
+
+// index of the region with this name in device_regions, -1 if the device has none
+static int region_name_index(const char *region_name) {
+    int i = ph_lookup(&region_name_table, ph_key_str(region_name));
+    return (i >= 0 && !strncmp(region_name, device_regions[i].regionName, REGION_NAME_SZ)) ? i : -1;
+}
+
+// index of the user with this uid in device_users, -1 if the device has none
+static int user_index(u32 uid) {
+    int i = ph_lookup(&uid_table, uid);
+    return (i >= 0 && device_users[i].uid == uid) ? i : -1;
+}
+
+// index of the user with this name in device_users, -1 if the device has none
+static int username_index(const char *username) {
+    int i = ph_lookup(&username_table, ph_key_str(username));
+    return (i >= 0 && !strncmp(username, device_users[i].username, USERNAME_SZ)) ? i : -1;
+}
+
+// index of the login of device user i in device_logins, -1 if the user is not provisioned
+static int login_index(int i) {
+    int lo = 0, hi = NUM_PROVISIONED_USERS - 1;
+
+    while (i >= 0 && lo <= hi) {
+        int mid = (lo + hi) / 2;
+        if (device_logins[mid].user == i) {
+            return mid;
+        } else if (device_logins[mid].user < i) {
+            lo = mid + 1;
+        } else {
+            hi = mid - 1;
         }
     }
-    return FALSE;
+    return -1;
+}
+
+// whether device region i has been provisioned
+static int region_provisioned(int i) {
+    return i >= 0 && has_bit(provisioned_region_bits, i);
+}
+
+// index of the next set bit of a bitmap from bit i on, words * 32 if there is none
+static u32 next_bit(const u32 *bits, u32 words, u32 i) {
+    while (i < words * 32) {
+        u32 word = bits[i / 32] >> (i % 32);
+        if (word) {
+            while (!(word & 1)) {
+                word >>= 1;
+                i++;
+            }
+            return i;
+        }
+        i = (i / 32 + 1) * 32;
+    }
+    return words * 32;
+}
+
+// returns whether an rid has been provisioned
+int is_provisioned_rid(u32 rid) {
+    return region_provisioned(region_index(rid));
 }
 
 // looks up the region name corresponding to the rid
 int rid_to_region_name(u32 rid, char **region_name, int provisioned_only) {
-    for (int i = 0; i < NUM_REGIONS; i++) {
-        if (rid == device_regions[i].regionID &&
-            (!provisioned_only || is_provisioned_rid(rid))) {
-            *region_name = (char *)device_regions[i].regionName;
-            return TRUE;
-        }
+    int i = region_index(rid);
+
+    if (i >= 0 && (!provisioned_only || region_provisioned(i))) {
+        *region_name = (char *)device_regions[i].regionName;
+        return TRUE;
     }
 
-    mb_printf("Could not find region ID '%d'\r\n", rid);
+    log_warn("Could not find region ID '%d'", rid);
     *region_name = "<unknown region>";
     return FALSE;
 }
@@ -97,15 +214,14 @@ int rid_to_region_name(u32 rid, char **region_name, int provisioned_only) {
 
 // looks up the rid corresponding to the region name
 int region_name_to_rid(char *region_name, char *rid, int provisioned_only) {
-    for (int i = 0; i < NUM_REGIONS; i++) {
-        if (!strcmp(region_name, device_regions[i].regionName) &&
-            (!provisioned_only || is_provisioned_rid(device_regions[i].regionID))) {
-            *rid = device_regions[i].regionID;
-            return TRUE;
-        }
+    int i = region_name_index(region_name);
+
+    if (i >= 0 && (!provisioned_only || region_provisioned(i))) {
+        *rid = device_regions[i].regionID;
+        return TRUE;
     }
 
-    mb_printf("Could not find region name '%s'\r\n", region_name);
+    log_warn("Could not find region name '%s'", region_name);
     *rid = -1;
     return FALSE;
 }
@@ -113,26 +229,20 @@ int region_name_to_rid(char *region_name, char *rid, int provisioned_only) {
 
 // returns whether a uid has been provisioned
 int is_provisioned_uid(u32 uid) {
-    for (int i = 0; i < NUM_PROVISIONED_USERS; i++) {
-        if (uid == provisioned_uid[i].provisioned_userID) {
-            return TRUE;
-        }
-    }
-    return FALSE;
+    return login_index(user_index(uid)) >= 0;
 }
 
 
 // looks up the username corresponding to the uid
 int uid_to_username(u32 uid, char **username, int provisioned_only) {
-    for (int i = 0; i < NUM_USERS; i++) {
-        if (uid == device_users[i].uid &&
-            (!provisioned_only || is_provisioned_uid(uid))) {
-            *username = (char *)device_users[i].username;
-            return TRUE;
-        }
+    int i = user_index(uid);
+
+    if (i >= 0 && (!provisioned_only || login_index(i) >= 0)) {
+        *username = (char *)device_users[i].username;
+        return TRUE;
     }
 
-    mb_printf("Could not find uid '%d'\r\n", uid);
+    log_warn("Could not find uid '%d'", uid);
     *username = "<unknown user>";
     return FALSE;
 }
@@ -140,88 +250,104 @@ int uid_to_username(u32 uid, char **username, int provisioned_only) {
 
 // looks up the uid corresponding to the username
 int username_to_uid(char *username, u32 *uid, int provisioned_only) {
-    for (int i = 0; i < NUM_USERS; i++) {
-        if (!strncmp(username, device_users[i].username, strlen(device_users[i].username)) &&
-            (!provisioned_only || is_provisioned_uid(device_users[i].uid))) {
-            *uid = device_users[i].uid;
-            return TRUE;
-        }
+    int i = username_index(username);
+
+    if (i >= 0 && (!provisioned_only || login_index(i) >= 0)) {
+        *uid = device_users[i].uid;
+        return TRUE;
     }
 
-    mb_printf("Could not find username '%s'\r\n", username);
+    log_warn("Could not find username '%s'", username);
     *uid = -1;
     return FALSE;
 }
 
-// Converts hex string to binary array
-static size_t hextobin(unsigned char *dst, const char *src) {
-	size_t num;
-	unsigned acc;
-	int z;
-
-	num = 0;
-	z = 0;
-	acc = 0;
-	while (*src != 0) {
-		int c = *src++;
-		if (c >= '0' && c <= '9') {
-			c -= '0';
-		} else if (c >= 'A' && c <= 'F') {
-			c -= ('A' - 10);
-		} else if (c >= 'a' && c <= 'f') {
-			c -= ('a' - 10);
-		} else {
-			continue;
-		}
-		if (z) {
-			*dst++ = (acc << 4) + c;
-			num++;
-		} else {
-			acc = c;
-		}
-		z = !z;
-	}
-	return num;
-}
-
-// Hashes a given pin and stores it into the buffer
-void hash_pin(const char *pin, const char *salt, unsigned char *hashpinBuffer) {
-	char concatPin[MAX_PIN_SZ + SALT_SZ];
-	memset(concatPin, 0, sizeof(concatPin));
-
-	strncpy(concatPin, pin, strlen(pin));
-	strncat(concatPin, salt, strlen(salt));
-
+// Hashes a given pin followed by its SALT_LEN character salt and stores it into the buffer
+COLD_CODE void hash_pin(const char *pin, const char *salt, unsigned char *hashpinBuffer) {
     br_sha256_context ctx;
 
     br_sha256_init(&ctx);
 
-    br_sha256_update(&ctx, concatPin, strlen(concatPin));
+    br_sha256_update(&ctx, pin, strlen(pin));
+    br_sha256_update(&ctx, salt, SALT_LEN);
 
     br_sha256_out(&ctx, hashpinBuffer);
 }
 
-// Validates a given encrypted waveHeader
-unsigned int read_header(struct chachapoly_ctx *ctx, waveHeaderMetaStruct *waveHeaderMeta) {
-	unsigned char nonce[NONCE_SIZE];
-	unsigned char tag[MAC_SIZE];
-	unsigned char aad[12] = "wave_header";
+// Validates a given encrypted song header, v1 headers are filled in with the fixed v1 layout
+unsigned int read_header(struct chachapoly_ctx *ctx, songHeaderStruct *header) {
+	songPrefix prefix;
+	int ret;
 
 	//set_working();
 
-	memcpy(nonce, (void *)&(c->encWaveHeaderMeta.nonce), NONCE_SIZE);
-	memcpy(tag, (void *)&(c->encWaveHeaderMeta.tag), MAC_SIZE);
+	shm_snapshot(&prefix, &c->encSongHeader.prefix, sizeof(songPrefix));
 
-	int ret = chachapoly_crypt(ctx, nonce, &aad, sizeof(aad), (waveHeaderMetaStruct *) &c->encWaveHeaderMeta.wave_header_meta, sizeof(waveHeaderMetaStruct), waveHeaderMeta, tag, MAC_SIZE, 0);
+	if (!memcmp(prefix.magic, DRM_MAGIC, DRM_MAGIC_SZ)) {
+		encryptedSongHeader enc_header;
+		unsigned char aad[12 + sizeof(songPrefix)] = "wave_header";
+		u32 header_sz;
+
+		if (prefix.version != DRM_FORMAT_V2 || (prefix.flags & ~SONG_KNOWN_FLAGS)
+				|| ((prefix.flags & SONG_FLAG_HEADER_HASH) && (prefix.flags & SONG_HEADER_HASH_NEEDS) != SONG_HEADER_HASH_NEEDS)) {
+			log_error("Unsupported song format version %u flags %x", prefix.version, prefix.flags);
+			set_stopped();
+			return -1;
+		}
+
+		// The prefix is authenticated along with the header
+		shm_snapshot(&enc_header, &c->encSongHeader, sizeof(encryptedSongHeader));
+		memcpy(aad + 12, &enc_header.prefix, sizeof(songPrefix));
+
+		// Songs without a merkle root have a shorter header with the tag straight after it
+		header_sz = SONG_HEADER_SZ(prefix.flags);
+		ret = chachapoly_crypt(ctx, enc_header.nonce, aad, sizeof(aad), &enc_header.header, header_sz, header, (u8 *) &enc_header.header + header_sz, MAC_SIZE, 0);
+
+		// Chunks have to fit the playback buffers and stay word aligned
+		if (ret == CHACHAPOLY_OK
+				&& (header->chunk_size < MIN_CHUNK_SZ || header->chunk_size > SONG_CHUNK_SZ
+					|| (header->chunk_size & 3)
+					|| header->num_chunks != header->wave_header.wav_size / header->chunk_size + 1)) {
+			log_error("Unsupported chunk size %u", header->chunk_size);
+			set_stopped();
+			return -1;
+		}
+	} else {
+		encryptedWaveheader enc_header;
+		unsigned char aad[12] = "wave_header";
+
+		shm_snapshot(&enc_header, &c->encWaveHeaderMeta, sizeof(encryptedWaveheader));
+
+		ret = chachapoly_crypt(ctx, enc_header.nonce, &aad, sizeof(aad), &enc_header.wave_header_meta, sizeof(waveHeaderMetaStruct), header, enc_header.tag, MAC_SIZE, 0);
+
+		header->chunk_size = SONG_CHUNK_SZ;
+		header->num_chunks = header->wave_header.wav_size / SONG_CHUNK_SZ + 1;
+		header->index_offset = 0;
+		prefix.flags = 0;
+	}
+
+	// miPod sizes the metadata record from the prefix flags, the header has to agree with them
+	if (ret == CHACHAPOLY_OK
+			&& header->metadata_size != (prefix.flags & SONG_FLAG_COMPACT_METADATA ? COMPACT_MD_SZ : METADATA_SZ)) {
+		log_error("Unsupported metadata size %u", header->metadata_size);
+		set_stopped();
+		return -1;
+	}
 
 	if (ret == CHACHAPOLY_OK) {
-		mb_printf("File header validated\r\n");
+		log_debug("File header validated");
 
-		s.total_bytes_to_play = waveHeaderMeta->wave_header.wav_size;
+		s.song_flags = prefix.flags;
+		if (prefix.flags & SONG_FLAG_HEADER_HASH) {
+			memcpy(s.nonce_prefix, header->nonce_prefix, NONCE_PREFIX_SZ);
+		}
+		s.total_bytes_to_play = header->wave_header.wav_size;
+		c->index_offset = header->index_offset;
+		merkle_init(&song_tree);
 
-		return waveHeaderMeta->metadata_size;
+		return header->metadata_size;
 	} else {
-		mb_printf("Header modification detected!\r\n");
+		log_error("Header modification detected!");
 		set_stopped();
 		return -1;
 	}
@@ -229,50 +355,141 @@ unsigned int read_header(struct chachapoly_ctx *ctx, waveHeaderMetaStruct *waveH
 	return 1;
 }
 
-// Validates a given metadata
-int read_metadata(struct chachapoly_ctx *ctx, encryptedMetadata *metadata) {
-	unsigned char nonce[NONCE_SIZE];
-	unsigned char tag[MAC_SIZE];
-	unsigned char aad[10] = "meta_data";
-	unsigned char metadata_buffer[METADATA_SZ];
+// Builds the authorization bitmaps of a song with a purdue_md, ids the device does not know are left out
+static void decode_purdue_md(const purdue_md *md, compact_md *auth) {
+	memset(auth, 0, sizeof(compact_md));
+	memcpy(auth->sha256sum, md->sha256sum, SHA_256_SUM_SZ);
+	auth->md_version = PURDUE_MD_VERSION;
+	auth->owner_id = md->owner_id;
+
+	for (int r = 0; r < md->num_regions && r < PURDUE_MD_REGIONS; r++) {
+		int i = region_index(md->provisioned_regions[r]);
+		if (i >= 0) {
+			set_bit(auth->region_bits, i);
+		}
+	}
 
-	memcpy(nonce, (unsigned char *)&(c->encMetadata.nonce), NONCE_SIZE);
-	memcpy(tag, (unsigned char *)&(c->encMetadata.tag), MAC_SIZE);
+	for (int u = 0; u < md->num_users && u < PURDUE_MD_USERS; u++) {
+		int i = user_index(md->provisioned_users[u]);
+		if (i >= 0) {
+			set_bit(auth->user_bits, i);
+		}
+	}
+}
 
-	int ret = chachapoly_crypt(ctx, nonce, &aad, sizeof(aad), (unsigned char *) &(c->encMetadata.metadata), METADATA_SZ, metadata_buffer, tag, MAC_SIZE, 0);
+// Validates a given metadata of either format, metadata_size picks the format
+int read_metadata(struct chachapoly_ctx *ctx, volatile encryptedMetadata *metadata, u32 metadata_size) {
+	encryptedMetadata *enc = &enc_metadata_buffer;
+	unsigned char metadata_buffer[METADATA_SZ];
+	int compact = (metadata_size == COMPACT_MD_SZ);
+	int cached;
+	int ret;
 
-	if (ret == CHACHAPOLY_OK) {
-		mb_printf("Metadata validated\r\n");
-		// Copy metadata into local state
-		memcpy(&s.purdue_md, metadata_buffer, METADATA_SZ);
-		return 0;
-	} else {
-		mb_printf("Metadata modification detected!\r\n");
+	if (!compact && metadata_size != METADATA_SZ) {
+		log_error("Unsupported metadata size %u", metadata_size);
 		set_stopped();
 		return -1;
 	}
-	return 1;
+
+	shm_snapshot(enc, metadata, NONCE_SIZE + MAC_SIZE + metadata_size);
+
+	// A record verified recently, e.g. queried before it is played, skips the AEAD
+	cached = md_cache_lookup(enc, metadata_size, metadata_buffer);
+	if (cached) {
+		tm_count(md_cache_hits);
+	} else {
+		tm_count(md_cache_misses);
+
+		if (compact) {
+			ret = chachapoly_crypt(ctx, enc->nonce, compact_md_aad, sizeof(compact_md_aad), enc->metadata, COMPACT_MD_SZ, metadata_buffer, enc->tag, MAC_SIZE, 0);
+		} else {
+			ret = chachapoly_crypt(ctx, enc->nonce, purdue_md_aad, sizeof(purdue_md_aad), enc->metadata, METADATA_SZ, metadata_buffer, enc->tag, MAC_SIZE, 0);
+		}
+
+		if (ret != CHACHAPOLY_OK) {
+			log_error("Metadata modification detected!");
+			set_stopped();
+			return -1;
+		}
+	}
+
+	// Copy metadata into local state, either way the song is authorized from the bitmaps
+	if (compact) {
+		memcpy(&s.song_auth, metadata_buffer, COMPACT_MD_SZ);
+		if (s.song_auth.md_version != COMPACT_MD_VERSION) {
+			log_error("Unsupported metadata version %u", s.song_auth.md_version);
+			set_stopped();
+			return -1;
+		}
+	} else {
+		memcpy(&s.purdue_md, metadata_buffer, METADATA_SZ);
+		decode_purdue_md(&s.purdue_md, &s.song_auth);
+	}
+
+	if (!cached) {
+		md_cache_insert(enc, metadata_size, metadata_buffer);
+	}
+
+	log_debug("Metadata validated%s", cached ? " (cached)" : "");
+	return 0;
+}
+
+// Whether the logged in user may play all of the current song
+// it has to be shared with them or owned by them, and allowed in a provisioned region
+static int song_authorized() {
+	u32 regions = 0;
+
+	for (int w = 0; w < REGION_WORDS; w++) {
+		regions |= s.song_auth.region_bits[w] & provisioned_region_bits[w];
+	}
+
+	if (!regions || !s.logged_in) {
+		return FALSE;
+	} else if (s.uid == s.song_auth.owner_id) {
+		return TRUE;
+	}
+
+	int i = user_index(s.uid);
+	return i >= 0 && has_bit(s.song_auth.user_bits, i);
 }
 
 // Read a chunk of specific size and number, decrypt and copy into the FIFO buffer
-int read_chunks(struct chachapoly_ctx *ctx, unsigned char *chunk_buffer, unsigned char *sha256sum, int chunk_size, int chunk_num, int buffer_loc) {
+// chunk_num counts from 1, counter nonce songs authenticate it so chunks only open in order
+// songs with the hash in their header authenticate their nonce prefix in place of the song hash
+HOT_CODE int read_chunks(struct chachapoly_ctx *ctx, unsigned char *chunk_buffer, unsigned char *sha256sum, int chunk_size, int chunk_num, int buffer_loc) {
 	unsigned char nonce[NONCE_SIZE];
 	unsigned char tag[MAC_SIZE];
-	int aad = chunk_num;
+	unsigned char aad[SHA_256_SUM_SZ + sizeof(u32)];
+	int aad_size = SHA_256_SUM_SZ;
 
 	// Copy data to buffers
-	memcpy(nonce, (unsigned char *) &c->encSongBuffer[buffer_loc].nonce, NONCE_SIZE);
-	memcpy(tag, (unsigned char *) &c->encSongBuffer[buffer_loc].tag, MAC_SIZE);
+	shm_snapshot(nonce, c->encSongBuffer[buffer_loc].nonce, NONCE_SIZE);
+	shm_snapshot(tag, c->encSongBuffer[buffer_loc].tag, MAC_SIZE);
+	shm_snapshot(chunk_buffer, c->encSongBuffer[buffer_loc].data, chunk_size);
 
-	// Decrypt the chunk
-	int ret = chachapoly_crypt(ctx, nonce, sha256sum, SHA_256_SUM_SZ, (unsigned char *)&c->encSongBuffer[buffer_loc].data, chunk_size, chunk_buffer, tag, MAC_SIZE, 0);
+	if (s.song_flags & SONG_FLAG_HEADER_HASH) {
+		memcpy(aad, s.nonce_prefix, NONCE_PREFIX_SZ);
+		aad_size = NONCE_PREFIX_SZ;
+	} else {
+		memcpy(aad, sha256sum, SHA_256_SUM_SZ);
+	}
+	if (s.song_flags & SONG_FLAG_COUNTER_NONCES) {
+		u32 index = chunk_num - 1;
+		memcpy(aad + aad_size, &index, sizeof(u32));
+		aad_size += sizeof(u32);
+	}
+
+	// Decrypt the chunk in place, the tag is checked before anything is overwritten
+	int ret = chachapoly_crypt(ctx, nonce, aad, aad_size, chunk_buffer, chunk_size, chunk_buffer, tag, MAC_SIZE, 0);
 
 	if (ret == CHACHAPOLY_OK) {
+		tm_count(chunks_verified);
+		if (s.song_flags & SONG_FLAG_MERKLE_ROOT) {
+			merkle_add(&song_tree, tag);
+		}
 		return 0;
 	} else {
-		mb_printf("The tags are not the same :( \r\n");
-		mb_printf("Chunk %i failed", chunk_num);
-		mb_printf("Modification detected!\r\n");
+		log_error("Chunk %i failed its tag check, modification detected!", chunk_num);
 		set_stopped();
 		return -1;
 	}
@@ -280,8 +497,37 @@ int read_chunks(struct chachapoly_ctx *ctx, unsigned char *chunk_buffer, unsigne
 	return 1;
 }
 
+// Checks that the metadata is that of the song whose header was read, for songs with the hash in their header
+// Their chunk aad no longer carries the song hash, this is what ties the metadata to the chunks
+int check_song_hash(songHeaderStruct *header) {
+	if ((s.song_flags & SONG_FLAG_HEADER_HASH) && memcmp(header->sha256sum, s.song_auth.sha256sum, SHA_256_SUM_SZ)) {
+		log_error("Metadata belongs to another song!");
+		set_stopped();
+		return -1;
+	}
+
+	return 0;
+}
+
+// Checks the chunk tags of a finished song against the merkle root in its header
+// Songs without a root always pass, the per-chunk tags are all they have
+int check_song_tree(songHeaderStruct *header) {
+	if (!(s.song_flags & SONG_FLAG_MERKLE_ROOT)) {
+		return 0;
+	}
+
+	if (merkle_check(&song_tree, header->merkle_root) != 0 || song_tree.leaves != header->num_chunks) {
+		log_error("Song integrity check failed, chunks were replaced or dropped!");
+		set_stopped();
+		return -1;
+	}
+
+	log_debug("Song integrity verified");
+	return 0;
+}
+
 // Toggle the offset for the chunk buffer
-int toggle_offset(int offset) {
+HOT_CODE int toggle_offset(int offset) {
 	if (!offset) {
 		offset = 1;
 	} else {
@@ -291,11 +537,52 @@ int toggle_offset(int offset) {
 	return offset;
 }
 
+// Ask miPod to refill one half of the encrypted song buffer
+HOT_CODE void request_refill(int half) {
+	c->refill_progress = 0;
+	c->buffer_offset = half;
+	c->refill_request++;
+	set_waiting_chunk();
+	tm_count(refill_waits);
+}
+
+// Record the FIFO running dry
+COLD_CODE void note_underrun(int chunk) {
+	tm_count(underruns);
+	log_warn("Audio underrun before chunk %d", chunk);
+}
+
+// Called while the next chunk has not been refilled yet
+// Flags the refill as urgent once the FIFO runs low and optionally pads it with silence
+HOT_CODE void ride_out_refill(int chunk, int *starved) {
+	u32 fill = *(u32 *) XPAR_FIFO_COUNT_AXI_GPIO_0_BASEADDR;
+
+	if (fill >= UNDERRUN_LOW_WATER) {
+		return;
+	}
+
+	c->refill_urgent = TRUE;
+
+	if (fill == 0 && !*starved) {
+		*starved = TRUE;
+		note_underrun(chunk);
+	}
+
+#if UNDERRUN_FILL_SILENCE
+	if (!XAxiDma_Busy(&sAxiDma, XAXIDMA_DMA_TO_DEVICE)) {
+		fnAudioPlay(sAxiDma, SILENCE_OFFSET, SILENCE_SZ);
+		tm_count(silence_frames);
+	}
+#endif
+}
+
 
 // Calculate metadata hash, encrypt metadta and store into metadata buffer
-void encryptMetaData(struct chachapoly_ctx *cha_ctx, char *metadata, encryptedMetadata *enc_metadata) {
+// metadata_size is METADATA_SZ or COMPACT_MD_SZ, each format has its own aad
+COLD_CODE void encryptMetaData(struct chachapoly_ctx *cha_ctx, char *metadata, u32 metadata_size, encryptedMetadata *enc_metadata) {
 	char nonce[NONCE_SIZE];
-	char aad[] = "meta_data";
+	const char *aad = metadata_size == COMPACT_MD_SZ ? compact_md_aad : purdue_md_aad;
+	u32 aad_size = metadata_size == COMPACT_MD_SZ ? sizeof(compact_md_aad) : sizeof(purdue_md_aad);
 	char tag_buffer[MAC_SIZE];
     
 	// Start nonce calculation
@@ -304,7 +591,7 @@ void encryptMetaData(struct chachapoly_ctx *cha_ctx, char *metadata, encryptedMe
     br_sha256_init(&ctx);
 
     // Calculate sha256 hash
-    br_sha256_update(&ctx, metadata, METADATA_SZ);
+    br_sha256_update(&ctx, metadata, metadata_size);
     char sha_compute[br_sha256_SIZE];
     br_sha256_out(&ctx, sha_compute);
 
@@ -312,7 +599,7 @@ void encryptMetaData(struct chachapoly_ctx *cha_ctx, char *metadata, encryptedMe
     memcpy(nonce, sha_compute, NONCE_SIZE);
 
     // Encrypt the metadata
-	chachapoly_crypt(cha_ctx, nonce, &aad, sizeof(aad), metadata, METADATA_SZ, enc_metadata->metadata, tag_buffer, MAC_SIZE, 1);
+	chachapoly_crypt(cha_ctx, nonce, aad, aad_size, metadata, metadata_size, enc_metadata->metadata, tag_buffer, MAC_SIZE, 1);
 
 	// Copy encrypted metadata to the command buffer
 	memcpy(enc_metadata->nonce, nonce, NONCE_SIZE);
@@ -323,180 +610,207 @@ void encryptMetaData(struct chachapoly_ctx *cha_ctx, char *metadata, encryptedMe
 
 //////////////////////// COMMAND FUNCTIONS ////////////////////////
 
-// attempt to log into the credentials in the shared buffer
-void login() {
+// attempt to log into the given credentials
+COLD_CODE int login(volatile char *username, volatile char *pin) {
+    char user[USERNAME_SZ + 1] = {0};
+    char user_pin[MAX_PIN_SZ + 1] = {0};
+
     if (s.logged_in) {
-        mb_printf("Already logged in. Please log out first.\r\n");
-        memcpy((void*)c->username, s.username, USERNAME_SZ);
-        memcpy((void*)c->pin, s.pin, MAX_PIN_SZ);
+        log_warn("Already logged in. Please log out first.");
+        shm_commit(username, s.username, USERNAME_SZ);
+        shm_commit(pin, s.pin, MAX_PIN_SZ);
+        return FALSE;
     } else {
-        for (int i = 0; i < NUM_PROVISIONED_USERS; i++) {
-            // search for matching username
-            if (!strcmp((void*)c->username, device_users[i].username)) {
-                
-                //MAKE FUNCTIONAL WITH HASHED VALUES
-            	unsigned char hashedPin[32];
-            	unsigned char binHash[32];
-
-            	hextobin(binHash, device_users[i].hashedPin);
-
-            	hash_pin((const char *)c->pin, device_users[i].salt, hashedPin);
-            	if (!strncmp(hashedPin, binHash, 32)) {
-                    // update states
-                    s.logged_in = 1;
-                    c->login_status = 1;
-
-                    // Copy username, pin and uid to local state
-                    memcpy(s.username, (void*)c->username, USERNAME_SZ);
-                    memcpy(s.pin, (void*)c->pin, MAX_PIN_SZ);
-                    s.uid = provisioned_uid[i].provisioned_userID;
-
-                    mb_printf("Logged in for user '%s'\r\n", c->username);
-                    return;
-                } else {
-                    // reject login attempt
-                    mb_printf("Incorrect pin for user '%s'\r\n", c->username);
-                    memset((void*)c->username, 0, USERNAME_SZ);
-                    memset((void*)c->pin, 0, MAX_PIN_SZ);
-                    return;
-                }
+        shm_snapshot(user, username, USERNAME_SZ);
+        shm_snapshot(user_pin, pin, MAX_PIN_SZ);
+
+        // search for matching username, only provisioned users have a login
+        int i = username_index(user);
+        int l = login_index(i);
+        if (l >= 0) {
+            unsigned char hashedPin[SHA_256_SUM_SZ];
+
+            hash_pin(user_pin, device_logins[l].salt, hashedPin);
+            if (!memcmp(hashedPin, device_logins[l].hashed_pin, SHA_256_SUM_SZ)) {
+                // update states
+                s.logged_in = 1;
+                c->login_status = 1;
+
+                // Copy username, pin and uid to local state
+                memcpy(s.username, user, USERNAME_SZ);
+                memcpy(s.pin, user_pin, MAX_PIN_SZ);
+                s.uid = device_users[i].uid;
+
+                log_info("Logged in for user '%s'", user);
+                return TRUE;
+            } else {
+                // reject login attempt
+                log_warn("Incorrect pin for user '%s'", user);
+                shm_clear(username, USERNAME_SZ);
+                shm_clear(pin, MAX_PIN_SZ);
+                return FALSE;
             }
         }
 
         // reject login attempt
-        mb_printf("User not found\r\n");
-        memset((void*)c->username, 0, USERNAME_SZ);
-        memset((void*)c->pin, 0, MAX_PIN_SZ);
+        log_warn("User not found");
+        shm_clear(username, USERNAME_SZ);
+        shm_clear(pin, MAX_PIN_SZ);
+        return FALSE;
     }
 }
 
 // attempt to log out
-void logout() {
+COLD_CODE int logout() {
     if (c->login_status) {
-        mb_printf("Logging out...\r\n");
+        log_info("Logging out...");
         s.logged_in = 0;
         c->login_status = 0;
-        memset((void*)c->username, 0, USERNAME_SZ);
-        memset((void*)c->pin, 0, MAX_PIN_SZ);
+        shm_clear(c->username, USERNAME_SZ);
+        shm_clear(c->pin, MAX_PIN_SZ);
         s.uid = 0;
+        return TRUE;
     } else {
-        mb_printf("Not logged in\r\n");
+        log_warn("Not logged in");
+        return FALSE;
     }
 }
 
 
-// handles a request to query the player's metadata
-void query_player() {
-    c->query.num_regions = NUM_PROVISIONED_REGIONS;
-    c->query.num_users = NUM_PROVISIONED_USERS;
+// publishes the counts and owner of a query whose names are already in place
+// names go straight from the device tables into the shared query, it is too large to build locally
+COLD_CODE void commit_query(volatile query *q, u32 num_regions, u32 num_users, u32 offset, const char *owner) {
+    query_head head;
 
-    for (int i = 0; i < NUM_PROVISIONED_REGIONS; i++) {
-        strcpy((char *)q_region_lookup(c->query, i), device_regions[i].regionName);
+    memset(&head, 0, sizeof(query_head));
+    head.num_regions = num_regions;
+    head.num_users = num_users;
+    head.page_users = offset < num_users ? num_users - offset : 0;
+    if (head.page_users > QUERY_PAGE_USERS) {
+        head.page_users = QUERY_PAGE_USERS;
     }
+    strncpy(head.owner, owner, USERNAME_SZ);
+
+    shm_commit(q, &head, sizeof(query_head));
+}
 
-    for (int i = 0; i < NUM_PROVISIONED_USERS; i++) {
-        strcpy((char *)q_user_lookup(c->query, i), device_users[i].username);
+// copies user name n of a query into the page starting at user offset, if it falls in the page
+static void commit_query_user(volatile query *q, u32 n, u32 offset, const char *username) {
+    if (n >= offset && n - offset < QUERY_PAGE_USERS) {
+        shm_commit(q->users + (n - offset) * USERNAME_SZ, username, USERNAME_SZ);
+    }
+}
+
+// handles a request to query the player's metadata, with the users from offset on
+COLD_CODE void query_player(volatile query *q, u32 offset) {
+    u32 num_regions = 0;
+
+    for (u32 b = next_bit(provisioned_region_bits, REGION_WORDS, 0); b < NUM_REGIONS;
+            b = next_bit(provisioned_region_bits, REGION_WORDS, b + 1)) {
+        shm_commit(q->regions + num_regions++ * REGION_NAME_SZ, device_regions[b].regionName, REGION_NAME_SZ);
     }
 
-    mb_printf("Queried player (%d regions, %d users)\r\n", c->query.num_regions, c->query.num_users);
+    for (u32 l = offset; l < NUM_PROVISIONED_USERS && l - offset < QUERY_PAGE_USERS; l++) {
+        commit_query_user(q, l, offset, device_users[device_logins[l].user].username);
+    }
+
+    commit_query(q, num_regions, NUM_PROVISIONED_USERS, offset, "");
+
+    log_info("Queried player (%d regions, %d users)", num_regions, NUM_PROVISIONED_USERS);
 
     return;
 }
 
-// handles a request to query song metadata
-void query_enc_song(unsigned char *key) {
+// handles a request to query song metadata of metadata_size plaintext bytes, with the users from offset on
+COLD_CODE int query_enc_song(const unsigned char *key, volatile encryptedMetadata *metadata, u32 metadata_size, volatile query *q, u32 offset) {
     char *name;
+    u32 num_regions = 0, num_users = 0;
 
     struct chachapoly_ctx ctx;
     chachapoly_init(&ctx, key, 256);
 
     // Decrypt metadata and set to internal state
-    encryptedMetadata metadata;
-    if (read_metadata(&ctx, &metadata) != 0) {
-    	mb_printf("Could not read metadata!\r\n");
-    	return;
+    if (read_metadata(&ctx, metadata, metadata_size) != 0) {
+    	log_error("Could not read metadata!");
+    	return FALSE;
     }
 
-    // Copy data into new metadata
-    memset((void *)&c->query, 0, sizeof(query));
-
-    //purdue_md is the song metadata
-    c->query.num_regions = s.purdue_md.num_regions;
-    c->query.num_users = s.purdue_md.num_users;
-
-    // copy owner name
-    uid_to_username(s.purdue_md.owner_id, &name, FALSE);
-    strcpy((char *)c->query.owner, name);
-
-    // copy region names
-    for (int i = 0; i < s.purdue_md.num_regions; i++) {
-        rid_to_region_name(s.purdue_md.provisioned_regions[i], &name, FALSE);
-        strcpy((char *)q_region_lookup(c->query, i), name);
+    // copy region names, in secrets file order, skipping empty words of the bitmaps
+    for (u32 b = next_bit(s.song_auth.region_bits, REGION_WORDS, 0); b < NUM_REGIONS;
+            b = next_bit(s.song_auth.region_bits, REGION_WORDS, b + 1)) {
+        shm_commit(q->regions + num_regions++ * REGION_NAME_SZ, device_regions[b].regionName, REGION_NAME_SZ);
     }
 
-    // copy authorized uid names
-    for (int i = 0; i < s.purdue_md.num_users; i++) {
-        uid_to_username(s.purdue_md.provisioned_users[i], &name, FALSE);
-        strcpy((char *)q_user_lookup(c->query, i), name);
+    // copy the page of authorized user names, counting all of them
+    for (u32 b = next_bit(s.song_auth.user_bits, USER_WORDS, 0); b < NUM_USERS;
+            b = next_bit(s.song_auth.user_bits, USER_WORDS, b + 1)) {
+        commit_query_user(q, num_users++, offset, device_users[b].username);
     }
 
-    mb_printf("Queried song (%d regions, %d users)\r\n", c->query.num_regions, c->query.num_users);
+    // copy owner name
+    uid_to_username(s.song_auth.owner_id, &name, FALSE);
+    commit_query(q, num_regions, num_users, offset, name);
+
+    log_info("Queried song (%d regions, %d users)", num_regions, num_users);
+    return TRUE;
 }
 
 // add a user to the song's list of users
-void share_enc_song(unsigned char *key) {
+// the re-encrypted metadata is written back over the given metadata, in the format it came in
+COLD_CODE int share_enc_song(const unsigned char *key, volatile encryptedMetadata *metadata, u32 metadata_size, volatile char *username) {
     u32 uid;
+    int i;
+    char target[USERNAME_SZ + 1] = {0};
+
+    shm_snapshot(target, username, USERNAME_SZ);
 
     struct chachapoly_ctx ctx;
     chachapoly_init(&ctx, key, 256);
 
-    encryptedMetadata metadata;
-    if (read_metadata(&ctx, &metadata) != 0) {
-    	mb_printf("Metadta could not be validated \r\n");
-    	set_stopped();
-    	return;
+    if (read_metadata(&ctx, metadata, metadata_size) != 0) {
+    	log_error("Metadata could not be validated");
+    	return FALSE;
     }
 
+    i = username_index(target);
+
     // Check if a user is logged in
     if (!s.logged_in) {
-        mb_printf("No user is logged in. Cannot share song\r\n");
-        c->share_rejected = 1;
-        set_stopped();
-		return;
+        log_warn("No user is logged in. Cannot share song");
+		return FALSE;
     // Check if the user that is logged in is the owner of the song
-    } else if (s.uid != s.purdue_md.owner_id) {
-        mb_printf("User '%s' is not song's owner. Cannot share song\r\n", s.username);
-        c->share_rejected = 1;
-        set_stopped();
-        return;
+    } else if (s.uid != s.song_auth.owner_id) {
+        log_warn("User '%s' is not song's owner. Cannot share song", s.username);
+        return FALSE;
     // Check if the username is a valid user
-    } else if (!username_to_uid((char *)c->username, &uid, TRUE)) {
-        mb_printf("Username not found\r\n");
-        c->share_rejected = 1;
-        set_stopped();
-        return;
+    } else if (login_index(i) < 0) {
+        log_warn("Username not found");
+        return FALSE;
     // Check if they own the song
-    } else if(uid == s.purdue_md.owner_id){
-        mb_printf("User is owner\r\n");
-        c->share_rejected = 1;
-        set_stopped();
-		return;
+    } else if(device_users[i].uid == s.song_auth.owner_id){
+        log_warn("User is owner");
+		return FALSE;
+	// Check if the song is already shared with them
+	} else if (has_bit(s.song_auth.user_bits, i)) {
+		log_warn("User is already shared");
+		return FALSE;
 	// Check if the song has already been shared to the max amount of users
-	} else if(s.purdue_md.num_users == MAX_USERS) {
-		mb_printf("User has already shared this song to the max amount of users\r\n");
-		c->share_rejected = 1;
-		set_stopped();
-		return;
+	} else if(s.song_auth.md_version == PURDUE_MD_VERSION && s.purdue_md.num_users == PURDUE_MD_USERS) {
+		log_warn("User has already shared this song to the max amount of users");
+		return FALSE;
 	}
 
+	uid = device_users[i].uid;
 
-	for(int i = 0; i < s.purdue_md.num_users; i++){
-		if(uid == s.purdue_md.provisioned_users[i]){
-       		mb_printf("User is already shared\r\n");
-       		c->share_rejected = 1;
-       		set_stopped();
-			return;
-		}
+	// Compact metadata keeps its size, only the user's bit changes
+	if (s.song_auth.md_version == COMPACT_MD_VERSION) {
+		set_bit(s.song_auth.user_bits, i);
+		encryptMetaData(&ctx, (char *) &s.song_auth, COMPACT_MD_SZ, &enc_metadata_buffer);
+		md_cache_insert(&enc_metadata_buffer, COMPACT_MD_SZ, (unsigned char *) &s.song_auth);
+		shm_commit(metadata, &enc_metadata_buffer, NONCE_SIZE + MAC_SIZE + COMPACT_MD_SZ);
+
+		log_info("Shared song with '%s'", target);
+		return TRUE;
 	}
 
     // Initialize empty struct
@@ -528,25 +842,27 @@ void share_enc_song(unsigned char *key) {
     memcpy(metadata_buffer, &newMetaData, sizeof(purdue_md));
 
     // Encrypt the new metadata and copy it into the command buffer
-    encryptMetaData(&ctx, metadata_buffer, (encryptedMetadata *)&c->encMetadata);
+    encryptMetaData(&ctx, metadata_buffer, METADATA_SZ, &enc_metadata_buffer);
+    md_cache_insert(&enc_metadata_buffer, METADATA_SZ, (unsigned char *) metadata_buffer);
+    shm_commit(metadata, &enc_metadata_buffer, sizeof(encryptedMetadata));
 
-    mb_printf("Shared song with '%s'\r\n", c->username);
+    log_info("Shared song with '%s'", target);
 
-    return;
+    return TRUE;
 }
 
 // removes DRM data from song for digital out
-void digital_out(unsigned char *key) {
+HOT_CODE void digital_out(const unsigned char *key) {
 	struct chachapoly_ctx ctx;
 	chachapoly_init(&ctx, key, 256);
 
-	waveHeaderMetaStruct waveHeaderMeta;
-	encryptedMetadata metadata;
+	songHeaderStruct songHeader;
 
 	// Metadata information
 	int metadata_size = 0;
 	int chunks_to_read, chunk_counter = 1;
 	int chunk_remainder;
+	int song_chunk_sz = SONG_CHUNK_SZ;
 
 	// TODO: change buffer_offset to boolean
 	// Initialize buffer offset;
@@ -557,32 +873,34 @@ void digital_out(unsigned char *key) {
 	set_waiting_file_header();
 
 	while (1) {
-		while (InterruptProcessed) {
-			InterruptProcessed = FALSE;
+		flush_led();
+
+		while (idle_take(WAKE_CMD)) {
 			set_working();
 
 			switch (c->cmd) {
 			case READ_HEADER:
-				metadata_size = read_header(&ctx, &waveHeaderMeta);
+				metadata_size = read_header(&ctx, &songHeader);
 				if (metadata_size == -1) {
-					mb_printf("Song not valid!\r\n");
+					log_error("Song not valid!");
 					return;
 				}
 
 				c->metadata_size = metadata_size;
 
 				// copy wave header to buffer
-				memcpy((unsigned char *)&c->wave_header, &waveHeaderMeta.wave_header, WAVE_HEADER_SZ);
+				shm_commit(&c->wave_header, &songHeader.wave_header, WAVE_HEADER_SZ);
 
 				set_waiting_metadata();
 
-				chunks_to_read = waveHeaderMeta.wave_header.wav_size / SONG_CHUNK_SZ;
-				chunk_remainder = waveHeaderMeta.wave_header.wav_size % SONG_CHUNK_SZ;
+				song_chunk_sz = songHeader.chunk_size;
+				chunks_to_read = songHeader.num_chunks - 1;
+				chunk_remainder = songHeader.wave_header.wav_size - chunks_to_read * song_chunk_sz;
 				break;
 			case READ_METADATA:
-				if (read_metadata(&ctx, &metadata) == 0) {
+				if (read_metadata(&ctx, &c->encMetadata, metadata_size) == 0 && check_song_hash(&songHeader) == 0) {
 					c->total_chunks = chunks_to_read;
-					c->chunk_size = SONG_CHUNK_SZ;
+					c->chunk_size = song_chunk_sz;
 					c->chunk_remainder = chunk_remainder;
 					set_waiting_chunk();
 					break;
@@ -606,18 +924,23 @@ void digital_out(unsigned char *key) {
 
 				int buffer_loc = buffer_counter++ + ((ENC_BUFFER_SZ / 2) * buffer_offset);
 
-				// Check if on the last chunk
-				int chunk_size = SONG_CHUNK_SZ;
-				if (chunk_counter == chunks_to_read) {
+				// The remainder chunk comes last
+				int chunk_size = song_chunk_sz;
+				if (chunk_counter == songHeader.num_chunks) {
 					chunk_size = chunk_remainder;
 				}
 
-				if (read_chunks(&ctx, chunk_buffer, s.purdue_md.sha256sum, chunk_size, chunk_counter, buffer_loc) == 0) {
-					memcpy((unsigned char *)&c->songBuffer[SONG_CHUNK_SZ * buffer_loc], chunk_buffer, chunk_size);
+				if (read_chunks(&ctx, chunk_buffer, s.song_auth.sha256sum, chunk_size, chunk_counter, buffer_loc) == 0) {
+					// The last chunk is only handed over once the whole song checks out
+					if (chunk_counter == songHeader.num_chunks && check_song_tree(&songHeader) != 0) {
+						return;
+					}
+
+					shm_commit(&c->songBuffer[SONG_CHUNK_SZ * buffer_loc], chunk_buffer, chunk_size);
 					chunk_counter++;
 					chunks_decrypted++;
 
-					if (chunk_counter + 1 == chunks_to_read) {
+					if (chunk_counter > songHeader.num_chunks) {
 						set_stopped();
 						return;
 					}
@@ -650,26 +973,29 @@ void digital_out(unsigned char *key) {
 				set_stopped();
 				break;
 			}
+		} else {
+			// Nothing to do until miPod's next command
+			wait_for_command();
 		}
 	}
 
-	mb_printf("Song dump finished\r\n");
+	log_info("Song dump finished");
 	set_stopped();
 	return;
 }
 
 
 //Audio output of the encrypted song
-void play_encrypted_song(unsigned char *key) {
+HOT_CODE void play_encrypted_song(const unsigned char *key) {
 	struct chachapoly_ctx ctx;
 	chachapoly_init(&ctx, key, 256);
 
-	waveHeaderMetaStruct waveHeaderMeta;
-	encryptedMetadata metadata;
+	songHeaderStruct songHeader;
 
 	int metadata_size = 0;
 	int chunks_to_read, chunk_counter = 1;
 	int chunk_remainder;
+	int song_chunk_sz = SONG_CHUNK_SZ;
 
 	// Boolean for 30s buffer
 	int song_playable = FALSE;
@@ -683,37 +1009,49 @@ void play_encrypted_song(unsigned char *key) {
 
 	// DMA and fifo variables
 	int chunks_copied = 0;
+	int chunk_bytes = SONG_CHUNK_SZ;    // plaintext bytes in the chunk being copied
 	int bytes_to_play = SONG_CHUNK_SZ;
 	int first_time_play = TRUE;
 
+	// Refill handshake, both halves start out full
+	int refill_half = -1;       // half miPod is refilling
+	int refill_next = -1;       // half waiting for miPod to finish the current refill
+	int starved = FALSE;        // FIFO already ran dry waiting for this chunk
+
+	c->refill_complete = c->refill_request;
+	c->refill_urgent = FALSE;
+	memset((void *) (XPAR_MB_DMA_AXI_BRAM_CTRL_0_S_AXI_BASEADDR + SILENCE_OFFSET), 0, SILENCE_SZ);
+
 	set_waiting_file_header();
 
 	while (1) {
-		while (InterruptProcessed) {
-			InterruptProcessed = FALSE;
+		flush_led();
+
+		while (idle_take(WAKE_CMD)) {
 			set_working();
 
 			switch (c->cmd) {
 			case READ_HEADER:
-				metadata_size = read_header(&ctx, &waveHeaderMeta);
+				metadata_size = read_header(&ctx, &songHeader);
 				if (metadata_size == -1) {
-					mb_printf("Song not valid!\r\n");
+					log_error("Song not valid!");
 					return;
 				}
 				c->metadata_size = metadata_size;
 
 				// Determine how many chunks are going to be read
 				// Determine the last chunk size
-				chunks_to_read = waveHeaderMeta.wave_header.wav_size / SONG_CHUNK_SZ;
-				chunk_remainder = waveHeaderMeta.wave_header.wav_size % SONG_CHUNK_SZ;
+				song_chunk_sz = songHeader.chunk_size;
+				chunks_to_read = songHeader.num_chunks - 1;
+				chunk_remainder = songHeader.wave_header.wav_size - chunks_to_read * song_chunk_sz;
 
 				// Start waiting for metadata
 				set_waiting_metadata();
 				break;
 			case READ_METADATA:
-				if (read_metadata(&ctx, &metadata) == 0) {
+				if (read_metadata(&ctx, &c->encMetadata, metadata_size) == 0 && check_song_hash(&songHeader) == 0) {
 					c->total_chunks = chunks_to_read;
-					c->chunk_size = SONG_CHUNK_SZ;
+					c->chunk_size = song_chunk_sz;
 					c->chunk_remainder = chunk_remainder;
 					set_waiting_chunk();
 					break;
@@ -722,24 +1060,24 @@ void play_encrypted_song(unsigned char *key) {
 				}
             //Pause, play, restart and stop command handling
 			case PAUSE:
-				mb_printf("Pausing...\r\n");
+				log_info("Pausing...");
 				set_paused();
-				while(!InterruptProcessed) continue;
+				wait_for_command();
 				break;
 			case PLAY:
-				mb_printf("Playing...\r\n");
+				log_info("Playing...");
 				set_playing();
 				c->cmd = READ_CHUNK;
 				break;
 			case RESTART:
-				mb_printf("Restarting...\r\n");
+				log_info("Restarting...");
 				set_waiting_file_header();
 
 				usleep(500);
 
 				return;
 			case STOP:
-				mb_printf("Stopping playback...\r\n");
+				log_info("Stopping playback...");
 				return;
 			default:
 				break;
@@ -751,47 +1089,66 @@ void play_encrypted_song(unsigned char *key) {
 
 			// First time run
 			if (chunks_decrypted == 0) {
-				// Check if any of the song's regions match the player's regions
-				for (int i = 0; i < s.purdue_md.num_regions; i++) {
-					if (is_provisioned_rid(s.purdue_md.provisioned_regions[i])) {
-						// Check to see if logged in user owns the song
-						if (s.logged_in && s.uid == s.purdue_md.owner_id) {
-							song_playable = TRUE;
-						}
-
-						// If the song can be played in the region, check if the logged in user has the song shared to them
-						for (int n = 0; n < s.purdue_md.num_users; n++) {
-							if (s.uid == s.purdue_md.provisioned_users[n]) {
-								song_playable = TRUE;
-								break;
-							}
-						}
-					}
-				}
+				// Check the song's regions against the player's and the logged in user against the song's users
+				song_playable = song_authorized();
 
 				if (song_playable == FALSE) {
-					mb_printf("Song is not valid for the region or the user does not have access to this song\r\n");
-					mb_printf("Only playing 30s\r\n");
+					log_warn("Song is not valid for the region or the user does not have access to this song");
+					log_warn("Only playing 30s");
 				}
 
 				s.play_state = DECRYPT;
 			}
 
+			// Hand miPod the next refill once it has finished the last one
+			if (refill_half != -1 && c->refill_complete == c->refill_request) {
+				refill_half = -1;
+				c->refill_urgent = FALSE;
+
+				// miPod moves the shared state on to READING_CHUNK when it completes a refill
+				s.drm_state = READING_CHUNK;
+			}
+
+			if (refill_half == -1 && refill_next != -1) {
+				request_refill(refill_next);
+				refill_half = refill_next;
+				refill_next = -1;
+			}
+
 			if (s.play_state == DECRYPT) {
+				// miPod has not copied this chunk in yet, keep the audio path alive until it does
+				if (refill_half == buffer_offset && c->refill_progress <= buffer_counter) {
+					ride_out_refill(chunk_counter, &starved);
+					continue;
+				}
+
 				buffer_loc = buffer_counter++ + ((ENC_BUFFER_SZ / 2) * buffer_offset);
 
-				int chunk_size = SONG_CHUNK_SZ;
+				int chunk_size = song_chunk_sz;
 
-				// Check if on the last chunk
-				if (chunk_counter == chunks_to_read) {
+				// The remainder chunk comes last
+				if (chunk_counter == songHeader.num_chunks) {
 					chunk_size = chunk_remainder;
 				}
 
 				// Read and decrypt the chunk
-				if (read_chunks(&ctx, chunk_buffer, s.purdue_md.sha256sum, chunk_size, chunk_counter, buffer_loc) == 0) {
+				if (read_chunks(&ctx, chunk_buffer, s.song_auth.sha256sum, chunk_size, chunk_counter, buffer_loc) == 0) {
+					// The last chunk is only played once the whole song checks out
+					if (chunk_counter == songHeader.num_chunks && check_song_tree(&songHeader) != 0) {
+						return;
+					}
+
 					chunk_counter++;
 					chunks_decrypted++;
+					chunk_bytes = chunk_size;
+					bytes_to_play = chunk_size;
 					s.play_state = COPY;
+
+					// Songs that are a whole number of chunks end on an empty remainder
+					if (chunk_size == 0) {
+						set_stopped();
+						return;
+					}
 				} else {
 					return;
 				}
@@ -804,12 +1161,6 @@ void play_encrypted_song(unsigned char *key) {
 				int cp_num = (bytes_to_play > CHUNK_SZ) ? CHUNK_SZ : bytes_to_play;
 				int offset = (chunks_copied % 2) ? 0 : CHUNK_SZ;
 
-				// Check if on the last chunk
-				// This is plus one because it gets increase after decrypting the chunk
-				if (chunk_counter + 1 == chunks_to_read) {
-					cp_num = chunk_remainder;
-				}
-
 				// Check if playing 30seconds
 				if (song_playable == FALSE && song_playable_byte_counter <= cp_num) {
 					cp_num = song_playable_byte_counter;
@@ -818,14 +1169,25 @@ void play_encrypted_song(unsigned char *key) {
 				// do first mem cpy here into DMA BRAM
 				Xil_MemCpy(
 						(void *) (XPAR_MB_DMA_AXI_BRAM_CTRL_0_S_AXI_BASEADDR + offset),
-						(void *) (chunk_buffer + SONG_CHUNK_SZ - bytes_to_play),
+						(void *) (chunk_buffer + chunk_bytes - bytes_to_play),
 						(u32) (cp_num));
+
+				// Track how close the FIFO came to draining
+				if (!first_time_play) {
+					u32 fill = *fifo_fill;
+					tm_low_water(fifo_low_water, fill);
+					if (fill == 0 && !starved) {
+						note_underrun(chunk_counter);
+					}
+					starved = FALSE;
+				}
+
 				// dma_busy will not report correctly the first time
 				// Check for first time run, then it should work correctly after
-				while (XAxiDma_Busy(&sAxiDma, XAXIDMA_DMA_TO_DEVICE)
-						&& !first_time_play
-						&& *fifo_fill < (FIFO_CAP - 32)
-						) {
+				// Only count the passes that find the DMA still busy
+				if (!first_time_play && !dma_ready()) {
+					tm_count(dma_waits);
+					idle_wait(WAKE_DMA);
 				}
 
 				if (first_time_play == TRUE) {
@@ -838,7 +1200,6 @@ void play_encrypted_song(unsigned char *key) {
 				song_playable_byte_counter -= cp_num;
 
 				if (bytes_to_play <= 0) {
-					bytes_to_play = SONG_CHUNK_SZ;
 					chunks_copied++;
 					s.play_state = DECRYPT;
 				}
@@ -847,31 +1208,21 @@ void play_encrypted_song(unsigned char *key) {
 				if (song_playable_byte_counter == 0 && song_playable == FALSE) {
 					set_stopped();
 					return;
-				} else if (chunk_counter + 1 == chunks_to_read) {
+				} else if (bytes_to_play <= 0 && chunk_counter > songHeader.num_chunks) {
 					set_stopped();
 					return;
 				}
 			}
 
-			// Request more chunks
-			if (s.play_state == REQUEST) {
-				set_waiting_chunk();
-
-				// Start decrypting more chunks
-				s.play_state = DECRYPT;
-			}
-
-			// Check if reached the end of the command buffer
-			// Then Alternate chunk buffer location
-			if (buffer_counter == (ENC_BUFFER_SZ / 2)) {
+			// Check if reached the end of the command buffer once the last chunk is copied
+			// Then Alternate chunk buffer location and queue a refill of the finished half
+			if (s.play_state == DECRYPT && buffer_counter == (ENC_BUFFER_SZ / 2)) {
 				// Reset the buffer location counter
 				buffer_counter = 0;
 
 				// Toggle offset
-				c->buffer_offset = buffer_offset;
+				refill_next = buffer_offset;
 				buffer_offset = toggle_offset(buffer_offset);
-
-				s.play_state = REQUEST;
 			}
 		}
 
@@ -879,12 +1230,72 @@ void play_encrypted_song(unsigned char *key) {
 		if (c->cmd == STOP) {
 			set_stopped();
 			break;
+		} else if (c->cmd != READ_CHUNK) {
+			// Nothing to do until miPod's next command
+			wait_for_command();
 		}
 	}
 	// TODO: Make sure playing a song follows original checks, IE: user logged in/song is shared with them/they own the song/can be played in that region
 }
 
 
+// drains the submission queue, running each queued command in order
+void process_queue(const unsigned char *key) {
+	volatile cmd_queue *q = &c->queue;
+	int processed = 0;
+
+	// miPod moves the tail, so it has to be at most a queue ahead of the completions
+	if (q->sq_tail - q->sq_head > CMD_QUEUE_SZ || q->cq_tail != q->sq_head) {
+		log_error("Command queue out of sync (sq %u-%u, cq %u)", q->sq_head, q->sq_tail, q->cq_tail);
+		q->sq_head = q->cq_tail = q->cq_head = q->sq_tail;
+		return;
+	}
+
+	while (q->sq_head != q->sq_tail) {
+		u32 slot = queue_slot(q->sq_head);
+		volatile cmd_queue_entry *e = &q->entries[slot];
+		int ok = TRUE;
+
+		switch (e->opcode) {
+		case LOGIN:
+			ok = login(e->username, e->pin);
+			e->result = s.logged_in;
+			break;
+		case LOGOUT:
+			ok = logout();
+			e->result = s.logged_in;
+			break;
+		case QUERY_PLAYER:
+			query_player(&e->query, e->query_offset);
+			e->result = e->query.num_users;
+			break;
+		case QUERY_ENC_SONG:
+			ok = query_enc_song(key, &e->metadata, e->metadata_size, &e->query, e->query_offset);
+			e->result = e->query.num_users;
+			break;
+		case ENC_SHARE:
+			ok = share_enc_song(key, &e->metadata, e->metadata_size, e->username);
+			e->result = !ok;
+			break;
+		default:
+			log_warn("Command %d cannot be queued", e->opcode);
+			ok = FALSE;
+			break;
+		}
+
+		e->status = ok ? QUEUE_DONE : QUEUE_FAILED;
+
+		// post the completion, then retire the submission
+		q->cq[queue_slot(q->cq_tail)] = slot;
+		q->cq_tail++;
+		q->sq_head++;
+		processed++;
+	}
+
+	log_debug("Processed %d queued commands", processed);
+}
+
+
 //////////////////////// MAIN ////////////////////////
 
 
@@ -914,45 +1325,58 @@ int main() {
         return XST_FAILURE;
     }
 
-    // Start the LED
+    // No DMA interrupt reaches the intc, so waits for the DMA poll it
+    idle_set_poll(WAKE_DMA, dma_ready);
+
+    // Start the LED, nothing has been published yet so the first state always goes out
     enableLED(led);
+    s.drm_state = -1;
     set_stopped();
+    flush_led();
 
-    // clear command channel
-    memset((void *)c, 0, sizeof(cmd_channel));
+    // Start the playback counters
+    telemetry_init();
 
-    mb_printf("Size of command channel %d", sizeof(cmd_channel));
+    // clear command channel
+    shm_clear(c, sizeof(cmd_channel));
 
-    mb_printf("Audio DRM Module has Booted\n\r");
-    // Load keys/secrets
-    unsigned char key[32];
+    log_debug("Size of command channel %d", (int)sizeof(cmd_channel));
+    log_debug("Hot code %d bytes at 0x%x, cold code %d bytes", (int)(__text_hot_end - __text_hot_start),
+            (u32)__text_hot_start, (int)(__text_cold_end - __text_cold_start));
 
-    hextobin(key, KEY_HEX);
+    log_info("Audio DRM Module has Booted");
+    // Secrets are binary in secrets.h, read straight from read only memory
+    const unsigned char *key = DEVICE_KEY;
 
     // Handle commands forever
     while(1) {
-        // wait for interrupt to start
-        if (InterruptProcessed) {
-            InterruptProcessed = FALSE;
-
+        // sleep until miPod sends a command
+        wait_for_command();
+        if (idle_take(WAKE_CMD)) {
             set_working();
 
             // c->cmd is set by the miPod player
             switch (c->cmd) {
             case LOGIN:
-                login();
+                login(c->username, c->pin);
                 break;
             case LOGOUT:
                 logout();
                 break;
             case QUERY_PLAYER:
-                query_player();
+                query_player(&c->query, c->query_offset);
                 break;
             case QUERY_ENC_SONG:
-            	query_enc_song(key);
+            	query_enc_song(key, &c->encMetadata, c->metadata_size, &c->query, c->query_offset);
             	break;
             case ENC_SHARE:
-            	share_enc_song(key);
+            	c->share_rejected = !share_enc_song(key, &c->encMetadata, c->metadata_size, c->username);
+            	break;
+            case BATCH:
+            	process_queue(key);
+            	break;
+            case STATS:
+            	telemetry_publish(&c->stats);
             	break;
             case DIGITAL_OUT:
                 digital_out(key);
@@ -965,7 +1389,7 @@ int main() {
             }
 
             // reset statuses and sleep to allow player to recognize WORKING state
-            strcpy((char *)c->username, s.username);
+            shm_commit(c->username, s.username, USERNAME_SZ);
             c->login_status = s.logged_in;
             usleep(500);
             set_stopped();
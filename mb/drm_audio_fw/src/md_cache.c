@@ -0,0 +1,86 @@
+#include <string.h>
+#include "md_cache.h"
+
+/*
+ * LRU cache of verified song metadata
+ *
+ * Entries are keyed by the nonce and Poly1305 tag of a metadata record and
+ * hold the plaintext it opened to. A record whose nonce and tag match an
+ * entry is answered from the cache without running the AEAD. That is safe
+ * without comparing the ciphertext: the entry is plaintext the device key
+ * authenticated under that nonce and tag, so a record that reuses them with
+ * other ciphertext still only yields what was genuinely sealed, never what
+ * the caller sent. The record size is part of the key because it picks the
+ * metadata format.
+ */
+
+typedef struct {
+	u32 last_used;          // 0 for an empty entry
+	u32 metadata_size;
+	unsigned char nonce[NONCE_SIZE];
+	unsigned char tag[MAC_SIZE];
+	unsigned char metadata[METADATA_SZ];
+} md_cache_entry;
+
+static md_cache_entry entries[MD_CACHE_ENTRIES];
+static u32 md_clock;
+
+// Returns the entry of a record, NULL if it is not cached
+static md_cache_entry *find(const encryptedMetadata *enc, u32 metadata_size) {
+	for (int i = 0; i < MD_CACHE_ENTRIES; i++) {
+		md_cache_entry *e = &entries[i];
+		if (e->last_used && e->metadata_size == metadata_size &&
+				!memcmp(e->tag, enc->tag, MAC_SIZE) && !memcmp(e->nonce, enc->nonce, NONCE_SIZE)) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+// Marks an entry most recently used, restarting the ages when the clock wraps
+static void touch(md_cache_entry *e) {
+	if (++md_clock == 0) {
+		for (int i = 0; i < MD_CACHE_ENTRIES; i++) {
+			entries[i].last_used = entries[i].last_used ? 1 : 0;
+		}
+		md_clock = 2;
+	}
+	e->last_used = md_clock;
+}
+
+// Copies the plaintext of a verified record into metadata, returns 1 on a hit and 0 on a miss
+int md_cache_lookup(const encryptedMetadata *enc, u32 metadata_size, unsigned char *metadata) {
+	md_cache_entry *e = find(enc, metadata_size);
+
+	if (!e) {
+		return 0;
+	}
+
+	touch(e);
+	memcpy(metadata, e->metadata, metadata_size);
+	return 1;
+}
+
+// Remembers the plaintext of a record that has just been verified or sealed, evicting the least recently used entry
+void md_cache_insert(const encryptedMetadata *enc, u32 metadata_size, const unsigned char *metadata) {
+	md_cache_entry *e = find(enc, metadata_size);
+
+	if (metadata_size > METADATA_SZ) {
+		return;
+	}
+
+	if (!e) {
+		e = &entries[0];
+		for (int i = 1; i < MD_CACHE_ENTRIES && e->last_used; i++) {
+			if (entries[i].last_used < e->last_used) {
+				e = &entries[i];
+			}
+		}
+	}
+
+	e->metadata_size = metadata_size;
+	memcpy(e->nonce, enc->nonce, NONCE_SIZE);
+	memcpy(e->tag, enc->tag, MAC_SIZE);
+	memcpy(e->metadata, metadata, metadata_size);
+	touch(e);
+}
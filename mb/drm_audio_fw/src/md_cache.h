@@ -0,0 +1,12 @@
+#ifndef MD_CACHE_H
+#define MD_CACHE_H
+#include "xil_types.h"
+#include "constants.h"
+
+// Recently verified metadata records, small enough to search linearly
+#define MD_CACHE_ENTRIES 8
+
+int md_cache_lookup(const encryptedMetadata *enc, u32 metadata_size, unsigned char *metadata);
+void md_cache_insert(const encryptedMetadata *enc, u32 metadata_size, const unsigned char *metadata);
+
+#endif
@@ -0,0 +1,81 @@
+#include <string.h>
+#include <bearssl_hash.h>
+#include "merkle.h"
+
+/*
+ * Merkle root over the chunk tags of a song (RFC 6962 shape)
+ *
+ *   leaf = SHA256(0x00 || chunk number (u32 le) || tag)
+ *   node = SHA256(0x01 || left || right)
+ *
+ * Chunks arrive in order, so only the roots of the perfect subtrees seen so
+ * far are kept. Two subtrees of the same size are merged as soon as the
+ * second one completes, and whatever is left is folded right to left at the
+ * end. A song of n chunks costs n leaf hashes and n - 1 node hashes over
+ * 37 and 65 bytes, against 16 KB of decryption per chunk.
+ */
+
+#define MERKLE_LEAF 0x00
+#define MERKLE_NODE 0x01
+
+static void merkle_node(unsigned char *out, const unsigned char *left, const unsigned char *right) {
+	br_sha256_context ctx;
+	unsigned char prefix = MERKLE_NODE;
+
+	br_sha256_init(&ctx);
+	br_sha256_update(&ctx, &prefix, 1);
+	br_sha256_update(&ctx, left, SHA_256_SUM_SZ);
+	br_sha256_update(&ctx, right, SHA_256_SUM_SZ);
+	br_sha256_out(&ctx, out);
+}
+
+void merkle_init(merkle_tree *t) {
+	t->depth = 0;
+	t->leaves = 0;
+}
+
+/*
+ * Adds the tag of the next chunk
+ */
+HOT_CODE void merkle_add(merkle_tree *t, const unsigned char *tag) {
+	br_sha256_context ctx;
+	unsigned char prefix = MERKLE_LEAF;
+	u32 index = t->leaves++;
+
+	if (t->depth == MERKLE_DEPTH) {
+		return;
+	}
+
+	br_sha256_init(&ctx);
+	br_sha256_update(&ctx, &prefix, 1);
+	br_sha256_update(&ctx, &index, sizeof(u32));
+	br_sha256_update(&ctx, tag, MAC_SIZE);
+	br_sha256_out(&ctx, t->pending[t->depth]);
+	t->size[t->depth++] = 1;
+
+	while (t->depth > 1 && t->size[t->depth - 1] == t->size[t->depth - 2]) {
+		merkle_node(t->pending[t->depth - 2], t->pending[t->depth - 2], t->pending[t->depth - 1]);
+		t->size[t->depth - 2] *= 2;
+		t->depth--;
+	}
+}
+
+/*
+ * Compares the root of every chunk added so far against root
+ * Returns 0 on a match
+ */
+int merkle_check(merkle_tree *t, const unsigned char *root) {
+	unsigned char acc[SHA_256_SUM_SZ];
+	int i;
+
+	if (!t->depth) {
+		return -1;
+	}
+
+	memcpy(acc, t->pending[t->depth - 1], SHA_256_SUM_SZ);
+	for (i = t->depth - 2; i >= 0; i--) {
+		merkle_node(acc, t->pending[i], acc);
+	}
+
+	return memcmp(acc, root, SHA_256_SUM_SZ) ? -1 : 0;
+}
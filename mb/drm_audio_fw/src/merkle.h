@@ -0,0 +1,22 @@
+#ifndef MERKLE_H
+#define MERKLE_H
+#include "xil_types.h"
+#include "constants.h"
+
+// Enough pending subtrees for 2^32 chunks
+#define MERKLE_DEPTH 32
+
+// Streaming root over the chunk tags of a song, fed one chunk at a time in order
+// pending[] holds perfect subtrees, largest first, with their leaf counts
+typedef struct {
+	unsigned char pending[MERKLE_DEPTH][SHA_256_SUM_SZ];
+	u32 size[MERKLE_DEPTH];
+	u32 depth;
+	u32 leaves;
+} merkle_tree;
+
+void merkle_init(merkle_tree *t);
+void merkle_add(merkle_tree *t, const unsigned char *tag);
+int merkle_check(merkle_tree *t, const unsigned char *root);
+
+#endif
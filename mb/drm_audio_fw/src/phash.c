@@ -0,0 +1,50 @@
+#include "phash.h"
+
+/*
+ * Hash and displace perfect hashing (CHD)
+ *
+ *   bucket = mix(key, 0) % buckets
+ *   slot   = mix(key, disp[bucket]) % size
+ *
+ * createDevice picks disp[] so every provisioned key lands on its own slot,
+ * which makes a lookup two multiply-xor mixes and a table read. Keys that
+ * are not in the set land on some slot too, so callers confirm the single
+ * candidate entry instead of scanning the table. Strings are first folded to
+ * a 32 bit key with FNV-1a. tools/createDevice has the same functions and
+ * the two must stay in step.
+ */
+
+#define FNV_OFFSET 0x811c9dc5
+#define FNV_PRIME 0x01000193
+
+static u32 ph_mix(u32 x, u32 seed) {
+	x ^= seed * 0x9e3779b9;
+	x ^= x >> 16;
+	x *= 0x85ebca6b;
+	x ^= x >> 13;
+	x *= 0xc2b2ae35;
+	x ^= x >> 16;
+	return x;
+}
+
+u32 ph_key_str(const char *s) {
+	u32 h = FNV_OFFSET;
+
+	while (*s) {
+		h ^= (unsigned char) *s++;
+		h *= FNV_PRIME;
+	}
+	return h;
+}
+
+/*
+ * Returns the table position of the only entry that can hold key, -1 for an empty table
+ */
+int ph_lookup(const ph_table *t, u32 key) {
+	if (!t->size) {
+		return -1;
+	}
+
+	u32 bucket = ph_mix(key, 0) % t->buckets;
+	return t->index[ph_mix(key, t->disp[bucket]) % t->size];
+}
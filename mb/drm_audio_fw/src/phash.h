@@ -0,0 +1,17 @@
+#ifndef PHASH_H
+#define PHASH_H
+#include "xil_types.h"
+
+// Minimal perfect hash over a fixed set of keys, the tables are generated by tools/createDevice
+// index[] maps each slot to the key's position in its device table
+typedef struct {
+	u32 size;               // number of keys and slots
+	u32 buckets;
+	const u16 *disp;        // per bucket seed, found by createDevice so that no two keys share a slot
+	const u16 *index;
+} ph_table;
+
+u32 ph_key_str(const char *s);
+int ph_lookup(const ph_table *t, u32 key);
+
+#endif
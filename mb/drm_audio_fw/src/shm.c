@@ -0,0 +1,83 @@
+#include <string.h>
+#include "shm.h"
+
+/*
+ * Access layer for the shared command channel
+ *
+ * Every access to shared DDR is a single beat bus transaction, so structs are
+ * copied in and out a word at a time and worked on in local memory. Only the
+ * shared side is kept word aligned, the local side may be at any alignment.
+ */
+
+/*
+ * Copies len bytes out of shared memory into a local buffer
+ */
+void shm_snapshot(void *dst, const volatile void *src, u32 len) {
+	const volatile u8 *s = src;
+	u8 *d = dst;
+
+	shm_barrier();
+
+	// bytes up to the first shared word boundary
+	while (len && ((UINTPTR)s & 3)) {
+		*d++ = *s++;
+		len--;
+	}
+
+	for (; len >= 4; len -= 4, s += 4, d += 4) {
+		u32 w = *(const volatile u32 *)s;
+		memcpy(d, &w, 4);
+	}
+
+	while (len--) {
+		*d++ = *s++;
+	}
+}
+
+/*
+ * Copies len bytes of a local buffer into shared memory
+ */
+void shm_commit(volatile void *dst, const void *src, u32 len) {
+	volatile u8 *d = dst;
+	const u8 *s = src;
+
+	// bytes up to the first shared word boundary
+	while (len && ((UINTPTR)d & 3)) {
+		*d++ = *s++;
+		len--;
+	}
+
+	for (; len >= 4; len -= 4, s += 4, d += 4) {
+		u32 w;
+		memcpy(&w, s, 4);
+		*(volatile u32 *)d = w;
+	}
+
+	while (len--) {
+		*d++ = *s++;
+	}
+
+	shm_barrier();
+}
+
+/*
+ * Zeroes len bytes of shared memory
+ */
+void shm_clear(volatile void *dst, u32 len) {
+	volatile u8 *d = dst;
+
+	while (len && ((UINTPTR)d & 3)) {
+		*d++ = 0;
+		len--;
+	}
+
+	for (; len >= 4; len -= 4, d += 4) {
+		*(volatile u32 *)d = 0;
+	}
+
+	while (len--) {
+		*d++ = 0;
+	}
+
+	shm_barrier();
+}
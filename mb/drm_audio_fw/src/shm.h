@@ -0,0 +1,12 @@
+#ifndef SHM_H
+#define SHM_H
+#include "xil_types.h"
+
+// Orders shared memory accesses around a snapshot or commit
+#define shm_barrier() __asm__ __volatile__ ("" ::: "memory")
+
+void shm_snapshot(void *dst, const volatile void *src, u32 len);
+void shm_commit(volatile void *dst, const void *src, u32 len);
+void shm_clear(volatile void *dst, u32 len);
+
+#endif
@@ -0,0 +1,34 @@
+#include <string.h>
+#include "telemetry.h"
+#include "shm.h"
+
+#if TELEMETRY
+telemetry tm;
+#endif
+
+// clears the live counters
+static void telemetry_reset() {
+#if TELEMETRY
+	memset(&tm, 0, sizeof(tm));
+	tm.fifo_low_water = 0xFFFFFFFF;
+#endif
+}
+
+/*
+ * Clears the counters
+ */
+void telemetry_init() {
+	telemetry_reset();
+}
+
+/*
+ * Copies the counters into the command channel and starts a new sample period
+ */
+void telemetry_publish(volatile telemetry *out) {
+#if TELEMETRY
+	shm_commit(out, &tm, sizeof(telemetry));
+#else
+	shm_clear(out, sizeof(telemetry));
+#endif
+	telemetry_reset();
+}
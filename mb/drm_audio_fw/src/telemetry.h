@@ -0,0 +1,25 @@
+#ifndef TELEMETRY_H
+#define TELEMETRY_H
+#include "constants.h"
+
+// Set to 0 to compile all telemetry out of the firmware
+#ifndef TELEMETRY
+#define TELEMETRY 1
+#endif
+
+#if TELEMETRY
+// live counters, kept in local memory so updating them costs no bus traffic
+// only events are counted, the Cora-Z7 design has no timer to count cycles with
+extern telemetry tm;
+
+#define tm_count(field)         (tm.field++)
+#define tm_low_water(field, v)  do { if ((v) < tm.field) tm.field = (v); } while (0)
+#else
+#define tm_count(field)
+#define tm_low_water(field, v)
+#endif
+
+void telemetry_init();
+void telemetry_publish(volatile telemetry *out);
+
+#endif
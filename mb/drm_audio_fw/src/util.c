@@ -35,7 +35,7 @@ void setLED(u32* led, struct color c){
 * @note		None.
 *
 ****************************************************************************/
-int SetUpInterruptSystem(XIntc *XIntcInstancePtr, XInterruptHandler hdlr)
+COLD_CODE int SetUpInterruptSystem(XIntc *XIntcInstancePtr, XInterruptHandler hdlr)
 {
 	int Status;
 
@@ -99,7 +99,7 @@ int SetUpInterruptSystem(XIntc *XIntcInstancePtr, XInterruptHandler hdlr)
  *
  * @return	none.
  *****************************************************************************/
-u32 fnAudioPlay(XAxiDma AxiDma, u32 offset, u32 u32NrSamples)
+HOT_CODE u32 fnAudioPlay(XAxiDma AxiDma, u32 offset, u32 u32NrSamples)
 {
 	u32 status;
 
@@ -109,7 +109,7 @@ u32 fnAudioPlay(XAxiDma AxiDma, u32 offset, u32 u32NrSamples)
 
 }
 
-XStatus fnConfigDma(XAxiDma *AxiDma)
+COLD_CODE XStatus fnConfigDma(XAxiDma *AxiDma)
 {
 	int Status;
 	XAxiDma_Config *pCfgPtr;
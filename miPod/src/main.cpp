@@ -4,6 +4,7 @@
  */
 
 #include "miPodCpp.h"
+#include "shm.h"
 
 #include <stdio.h>
 #include <sys/mman.h>
@@ -26,6 +27,13 @@
 //change headerfile so that all structs use std::string instead of char[] or char*
 volatile cmd_channel *c;
 
+#ifdef MIPOD_SIM
+// driving the DRM under qemu-system-microblazeel, see mb/drm_audio_fw/sim
+// the command channel and doorbell live in the file backing the simulated DDR
+#include "sim_map.h"
+static volatile uint32_t *doorbell;
+#endif
+
 //////////////////////// UTILITY FUNCTIONS ////////////////////////
 
 template<typename ...Args>
@@ -39,9 +47,57 @@ void send_command(int cmd) {
 		mp_print("Could not copy memory: ", (errno), "\r\n");
 	}
 
+#ifdef MIPOD_SIM
+	// the simulated DRM polls the doorbell in place of the gpio interrupt
+	__atomic_add_fetch(doorbell, 1, __ATOMIC_SEQ_CST);
+#else
 	//trigger gpio interrupt
 	system("devmem 0x41200000 32 0"); //reconsider the use of the system command
 	system("devmem 0x41200000 32 1"); //reconsider the use of the system command
+#endif
+}
+
+// number of entries reserved but not yet submitted to the DRM
+static uint32_t queued_commands = 0;
+
+// reserves the next free submission queue entry for a command
+// the entry is only visible to the DRM after submit_queue()
+volatile cmd_queue_entry *queue_command(int cmd) {
+	volatile cmd_queue *q = &c->queue;
+	uint32_t next = q->sq_tail + queued_commands;
+
+	// queue is full until completions are consumed
+	if (next - q->cq_head >= CMD_QUEUE_SZ) {
+		return NULL;
+	}
+
+	volatile cmd_queue_entry *e = &q->entries[queue_slot(next)];
+	memset((void *) e, 0, sizeof(cmd_queue_entry));
+	e->opcode = cmd;
+	e->seq = next;
+	e->status = QUEUE_SUBMITTED;
+
+	queued_commands++;
+	return e;
+}
+
+// publishes all reserved entries and rings the DRM once for the whole batch
+// returns once every submitted entry has a completion
+void submit_queue() {
+	volatile cmd_queue *q = &c->queue;
+
+	if (queued_commands == 0) {
+		return;
+	}
+
+	// entries must be complete in shared memory before the tail moves
+	__sync_synchronize();
+	q->sq_tail += queued_commands;
+	queued_commands = 0;
+
+	send_command(BATCH);
+	while (q->cq_tail != q->sq_tail) continue; // wait for DRM to drain the queue
+	while (c->drm_state == WORKING) continue;
 }
 
 // parses the input of a command with up to two arguments
@@ -77,6 +133,8 @@ void print_help() {
 			"  query <song.drm>: display information about the song\r\n",
 			"  share <song.drm>: <username>: share the song with the specified user\r\n",
 			"  play <song.drm>: play the song\r\n",
+			"  batch <script>: run a file of login/logout/query/share commands as one batch\r\n",
+			"  stats: print and reset the DRM playback counters\r\n",
 			"  exit: exit miPod\r\n",
 			"  help display this message\r\n");
 }
@@ -93,6 +151,44 @@ void print_playback_help() {
 			"  help: display this message\r\n");
 }
 
+// reads the v2 prefix of a song without moving through the file, false for v1 songs which have none
+bool read_song_prefix(FILE *fp, songPrefix *prefix) {
+	long pos = ftell(fp);
+
+	size_t read = fread(prefix, sizeof(songPrefix), 1, fp);
+	fseek(fp, pos, SEEK_SET);
+
+	return read == 1 && !memcmp(prefix->magic, DRM_MAGIC, DRM_MAGIC_SZ);
+}
+
+// returns the size of the encrypted header at the start of a song, v2 songs begin with a prefix
+long enc_header_size(FILE *fp) {
+	songPrefix prefix;
+
+	if (read_song_prefix(fp, &prefix)) {
+		long size = sizeof(encryptedSongHeader);
+		if (!(prefix.flags & SONG_FLAG_MERKLE_ROOT)) {
+			size -= SHA_256_SUM_SZ;
+		}
+		if (!(prefix.flags & SONG_FLAG_HEADER_HASH)) {
+			size -= SHA_256_SUM_SZ + NONCE_PREFIX_SZ;
+		}
+		return size;
+	}
+
+	return sizeof(encryptedWaveheader);
+}
+
+// returns the plaintext size of the metadata of a song, the DRM checks it against the header
+uint32_t song_metadata_size(FILE *fp) {
+	songPrefix prefix;
+
+	if (read_song_prefix(fp, &prefix) && (prefix.flags & SONG_FLAG_COMPACT_METADATA)) {
+		return COMPACT_MD_SZ;
+	}
+	return METADATA_SZ;
+}
+
 FILE *read_enc_file_header(std::string fname) {
 	FILE* fd;
 
@@ -103,7 +199,11 @@ FILE *read_enc_file_header(std::string fname) {
 		return NULL;
 	}
 
-	fread((encryptedWaveheader *) &(c->encWaveHeader), sizeof(encryptedWaveheader), 1, fd);
+	// v1 and v2 headers share the start of the union, the DRM tells them apart by the prefix
+	unsigned char header[sizeof(encryptedSongHeader)];
+	long header_size = enc_header_size(fd);
+	fread(header, header_size, 1, fd);
+	shm_commit(&c->encSongHeader, header, header_size);
 
 	send_command(READ_HEADER);
 	usleep(500);
@@ -113,6 +213,97 @@ FILE *read_enc_file_header(std::string fname) {
 
 }
 
+// loads the chunk offsets of a v2 song, published by the DRM once it has read the header
+// v1 songs have no index and are read front to back, returns the number of chunks indexed
+int load_chunk_index(FILE *fp, std::vector<uint32_t>& index) {
+	index.clear();
+
+	uint32_t index_offset = c->index_offset;
+	if (!index_offset) {
+		return 0;
+	}
+
+	long pos = ftell(fp);
+	fseek(fp, 0, SEEK_END);
+	long end = ftell(fp);
+
+	if ((long) index_offset + (long) sizeof(songIndexHeader) <= end) {
+		// The offsets follow the index tag, which is only checked by the tools
+		index.resize((end - index_offset - sizeof(songIndexHeader)) / sizeof(uint32_t));
+		fseek(fp, index_offset + sizeof(songIndexHeader), SEEK_SET);
+		index.resize(fread(index.data(), sizeof(uint32_t), index.size(), fp));
+	}
+
+	fseek(fp, pos, SEEK_SET);
+	return index.size();
+}
+
+// positions the song at a chunk through its index, chunks past the index keep reading in order
+void seek_enc_chunk(FILE *fp, std::vector<uint32_t>& index, uint32_t chunk) {
+	if (chunk < index.size()) {
+		fseek(fp, index[chunk], SEEK_SET);
+	}
+}
+
+// where the chunk records of the song being played come from
+struct chunk_reader {
+	FILE *fp;                           // the song file
+	FILE *store;                        // library chunk store of a stored song, NULL when the chunks are in the song
+	std::vector<uint32_t> index;        // chunk offsets in the song file of a v2 song
+	std::vector<storedChunk> stored;    // store offset and tag of every chunk of a stored song
+	uint32_t next_chunk;
+};
+
+// reads the manifest of a stored song and opens the chunk store next to it, returns the number of chunks listed
+// the song is positioned just past its metadata, other songs are left where they are
+int load_manifest(chunk_reader& r, std::string song_name) {
+	manifestHeader manifest;
+	long pos = ftell(r.fp);
+
+	if (fread(&manifest, sizeof(manifestHeader), 1, r.fp) != 1
+			|| memcmp(manifest.magic, MANIFEST_MAGIC, DRM_MAGIC_SZ)) {
+		fseek(r.fp, pos, SEEK_SET);
+		return 0;
+	}
+
+	if (manifest.version != STORE_VERSION) {
+		mp_print("Unsupported chunk store version ", (unsigned int) manifest.version, "\r\n");
+		return 0;
+	}
+
+	std::string::size_type slash = song_name.rfind('/');
+	std::string store_name = (slash == std::string::npos) ? "" : song_name.substr(0, slash + 1);
+	store_name.append(STORE_NAME);
+
+	r.store = fopen(store_name.c_str(), "rb");
+	if (r.store == NULL) {
+		mp_print("Could not open ", store_name, ":", (errno), "\r\n");
+		return 0;
+	}
+
+	r.stored.resize(manifest.num_chunks);
+	r.stored.resize(fread(r.stored.data(), sizeof(storedChunk), r.stored.size(), r.fp));
+	return r.stored.size();
+}
+
+// finds the chunks of a song once its metadata is loaded, through a manifest, the v2 index, or in file order
+void open_chunks(chunk_reader& r, std::string song_name) {
+	r.store = NULL;
+	r.next_chunk = 0;
+	r.stored.clear();
+
+	if (!load_manifest(r, song_name)) {
+		load_chunk_index(r.fp, r.index);
+	}
+}
+
+void close_chunks(chunk_reader& r) {
+	if (r.store != NULL) {
+		fclose(r.store);
+		r.store = NULL;
+	}
+}
+
 //Reads song metadata chunk by chunk and stores it in the file stream
 void read_enc_metadata(FILE *fp, int metadata_size) {
 	if (fp == NULL) {
@@ -125,7 +316,7 @@ void read_enc_metadata(FILE *fp, int metadata_size) {
 
 	fread(meta_buffer, metadata_total_size, 1, fp);
 
-	memcpy((void *)&(c->encMetadata), meta_buffer, metadata_total_size);
+	shm_commit(&c->encMetadata, meta_buffer, metadata_total_size);
 
 	send_command(READ_METADATA);
 
@@ -140,11 +331,87 @@ void read_enc_chunk(FILE *fp, int chunk_size, int buffer_loc) {
 
 	fread(buffer, chunk_total_size, 1, fp);
 
-	memcpy((void *)&(c->encSongBuffer[buffer_loc]), buffer, chunk_total_size);
+	shm_commit(&c->encSongBuffer[buffer_loc], buffer, chunk_total_size);
 
 	return;
 }
 
+// reads a chunk of a stored song, putting its record back together around the tag from the manifest
+void read_stored_chunk(FILE *store, storedChunk& entry, int chunk_size, int buffer_loc) {
+	int chunk_total_size = NONCE_SIZE + MAC_SIZE + chunk_size;
+
+	unsigned char buffer[chunk_total_size];
+
+	fseek(store, entry.offset, SEEK_SET);
+	fread(buffer, NONCE_SIZE, 1, store);
+	memcpy(buffer + NONCE_SIZE, entry.tag, MAC_SIZE);
+	fread(buffer + NONCE_SIZE + MAC_SIZE, chunk_size, 1, store);
+
+	shm_commit(&c->encSongBuffer[buffer_loc], buffer, chunk_total_size);
+}
+
+// reads the next chunk record of a song into a slot of the shared buffer
+void read_next_chunk(chunk_reader& r, int chunk_size, int buffer_loc) {
+	uint32_t chunk = r.next_chunk++;
+
+	if (r.store == NULL) {
+		seek_enc_chunk(r.fp, r.index, chunk);
+		read_enc_chunk(r.fp, chunk_size, buffer_loc);
+	} else if (chunk < r.stored.size()) {
+		read_stored_chunk(r.store, r.stored[chunk], chunk_size, buffer_loc);
+	}
+}
+
+// copies len bytes of the DRM log ring starting at byte counter pos
+void read_log_ring(volatile log_ring *ring, uint32_t pos, void *dst, uint32_t len) {
+	uint32_t first = std::min<uint32_t>(len, LOG_RING_SZ - log_pos(pos));
+
+	shm_snapshot(dst, &ring->buf[log_pos(pos)], first);
+	shm_snapshot((char *) dst + first, ring->buf, len - first);
+}
+
+// prints the messages the DRM has queued in its log ring
+void drain_drm_log() {
+	static const char *level_names[] = { "error: ", "warning: ", "", "debug: " };
+	static uint32_t dropped = 0;
+
+	volatile log_ring *ring = &c->log;
+	uint32_t head = ring->head;
+	uint32_t tail = ring->tail;
+
+	while (tail != head) {
+		uint8_t record[2];
+		char msg[LOG_MSG_SZ + 1];
+
+		read_log_ring(ring, tail, record, sizeof(record));
+		uint8_t level = std::min<uint8_t>(record[0], LOG_DEBUG);
+		uint8_t len = std::min<uint8_t>(record[1], LOG_MSG_SZ);
+
+		read_log_ring(ring, tail + 2, msg, len);
+		msg[len] = '\0';
+		tail += 2 + len;
+
+		std::cout << "MB> " + std::string(level_names[level]) + msg + "\r\n" << std::flush;
+	}
+
+	ring->tail = tail;
+
+	if (ring->dropped != dropped) {
+		mp_print("DRM dropped ", ring->dropped - dropped, " log messages\r\n");
+		dropped = ring->dropped;
+	}
+}
+
+// New thread for printing DRM log messages as they arrive
+void *log_thread(void *arg) {
+	while (1) {
+		drain_drm_log();
+		usleep(LOG_POLL_US);
+	}
+
+	return (void *) 0;
+}
+
 //New thread for requesting and decrypting chunks
 void *decryption_thread(void *song_name) {
 	mp_print("Starting decryption thread!\r\n");
@@ -177,9 +444,12 @@ void *decryption_thread(void *song_name) {
 		while (c->drm_state == WORKING)
 			continue;
 
+		chunk_reader chunks = { fp, NULL, {}, {}, 0 };
+
 		if (c->drm_state == WAITING_METADATA) {
 			int metadata_size = c->metadata_size;
 			read_enc_metadata(fp, metadata_size);
+			open_chunks(chunks, (char *) song_name);
 		}
 
 		while (c->drm_state == WAITING_METADATA) {
@@ -191,35 +461,50 @@ void *decryption_thread(void *song_name) {
 		// Initialize a buffer before playing
 		for (int i = 0; i < ENC_BUFFER_SZ; i++) {
 			int chunk_size = c->chunk_size;
-			read_enc_chunk(fp, chunk_size, i);
+			read_next_chunk(chunks, chunk_size, i);
 		}
 		send_command(READ_CHUNK);
 
 		while (1) {
-			if (c->drm_state == WAITING_CHUNK) {
-				// Read encrypted chunks from rfp
+			if (c->refill_request != c->refill_complete) {
+				uint32_t request = c->refill_request;
+				int offset = c->buffer_offset;
+
+				// Read encrypted chunks from rfp, publishing each one as it lands
+				// so the DRM can start on the half before the refill is done
 				for (int i = 0; i < ENC_BUFFER_SZ / 2; i++) {
 					int chunk_size = c->chunk_size;
 
 					// Check for offset
-					int buffer_loc = i
-							+ ((ENC_BUFFER_SZ / 2) * c->buffer_offset);
+					int buffer_loc = i + ((ENC_BUFFER_SZ / 2) * offset);
 
-					read_enc_chunk(fp, chunk_size, buffer_loc);
+					read_next_chunk(chunks, chunk_size, buffer_loc);
+
+					__sync_synchronize();
+					c->refill_progress = i + 1;
 				}
 
+				c->refill_complete = request;
 				c->drm_state = READING_CHUNK;
-				usleep(500);
+
+				// The DRM starved waiting on this refill, come straight back for the next one
+				if (c->refill_urgent) {
+					mp_print("DRM ran low on audio, refilling without delay\r\n");
+				} else {
+					usleep(500);
+				}
 			}
 
 			// Song playback stopped
 			if (c->drm_state == STOPPED) {
+				close_chunks(chunks);
 				fclose(fp);
 				break;
 			}
 
 			// Restarting playback
 			if (c->drm_state == WAITING_FILE_HEADER) {
+				close_chunks(chunks);
 				fclose(fp);
 				break;
 			}
@@ -233,15 +518,15 @@ void *decryption_thread(void *song_name) {
 
 //////////////////////// COMMAND FUNCTIONS ////////////////////////
 
-//Allows for a user to login to microblaze with username and pin
-void login(std::string& username, std::string& pin) {
+// checks that a username and pin are well formed before sending them to the DRM
+bool valid_credentials(std::string& username, std::string& pin) {
 	//TODO change pin.size() check to the password specified by the rules (5)
 
 	if (username.size() == 0 || pin.size() == 0 || username.size() > USERNAME_SZ
 			|| pin.size() > MAX_PIN_SZ) {
 		mp_print("Invalid user name/PIN\r\n");
 		print_help();
-		return;
+		return false;
 	}
 	if (username.find_first_not_of(
 			"abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ01234567890_")
@@ -250,11 +535,23 @@ void login(std::string& username, std::string& pin) {
 					"01234567890")
 					!= std::string::npos) {
 		mp_print("Error username/pin not valid\r\n");
+		return false;
+	}
+
+	return true;
+}
+
+//Allows for a user to login to microblaze with username and pin
+void login(std::string& username, std::string& pin) {
+	if (!valid_credentials(username, pin)) {
 		return;
 	}
 
-	strncpy((char *) c->username, username.c_str(), USERNAME_SZ);
-	strncpy((char *) c->pin, pin.c_str(), MAX_PIN_SZ);
+	// username and pin are adjacent in the channel, commit them together
+	char credentials[USERNAME_SZ + MAX_PIN_SZ] = {0};
+	strncpy(credentials, username.c_str(), USERNAME_SZ);
+	strncpy(credentials + USERNAME_SZ, pin.c_str(), MAX_PIN_SZ);
+	shm_commit(c->username, credentials, sizeof(credentials));
 
 	send_command(LOGIN);
     while (c->drm_state == STOPPED) continue; // wait for DRM to start working
@@ -267,93 +564,150 @@ void logout() {
 	send_command(LOGOUT);
 }
 
-// queries the DRM about the player
-// DRM will fill shared buffer with query content
-void query_player() {
-	// drive DRM
-	send_command(QUERY_PLAYER);
-    while (c->drm_state == STOPPED) continue; // wait for DRM to start working
-    while (c->drm_state == WORKING) continue; // wait for DRM to dump file
+// copies the filled part of a query page out of shared memory, found with shm_field
+// the user names of the page are appended to users
+void snapshot_query(queryStruct *q, const volatile void *shared, std::vector<std::string> &users) {
+	const volatile uint8_t *s = (const volatile uint8_t *) shared;
 
-    // print query results
-    std::string buffer((char *) q_region_lookup(c->query, 0));
+	shm_snapshot(q, s, offsetof(queryStruct, regions));
+
+	q->num_regions = std::min<uint32_t>(q->num_regions, MAX_REGIONS);
+	q->num_users = std::min<uint32_t>(q->num_users, MAX_USERS);
+	q->page_users = std::min<uint32_t>(q->page_users, QUERY_PAGE_USERS);
+
+	shm_snapshot(q->regions, s + offsetof(queryStruct, regions), q->num_regions * REGION_NAME_SZ);
+	shm_snapshot(q->users, s + offsetof(queryStruct, users), q->page_users * USERNAME_SZ);
+
+	for (unsigned int i = 0; i < q->page_users; i++) {
+		users.push_back(std::string(q_user_lookup((*q), i), strnlen(q_user_lookup((*q), i), USERNAME_SZ)));
+	}
+}
+
+// prints the user names of a query and ends the line
+void print_query_users(const std::vector<std::string> &users) {
+	for (size_t i = 0; i < users.size(); i++) {
+		std::cout << (i ? ", " : "") << users[i];
+	}
+	std::cout << "\r\n";
+}
+
+// prints the results of a player query, from a snapshot and all of its user names
+void print_player_query(const queryStruct *q, const std::vector<std::string> &users) {
+    std::string buffer((char *) q_region_lookup((*q), 0));
     mp_print( "Regions: " , buffer);
 
-    for (unsigned int i = 1; i < c->query.num_regions; i++) {
-    	buffer = std::string((char *) q_region_lookup(c->query, i));
+    for (unsigned int i = 1; i < q->num_regions; i++) {
+    	buffer = std::string((char *) q_region_lookup((*q), i));
     	std::cout << ", " << buffer;
     }
     std::cout << "\r\n";
 
     mp_print( "Authorized users: ");
-    if (c->query.num_users) {
-        buffer = std::string((char *)q_user_lookup(c->query, 0));
-        std::cout << buffer;
-        for (unsigned int i = 1; i < c->query.num_users; i++) {
-        	buffer = std::string((char *)q_user_lookup(c->query, i));
-            std::cout << ", " << buffer;
-        }
-    }
-    std::cout << "\r\n";
+    print_query_users(users);
 }
 
-//Queries metadata of encrypted song and prints information from metadata
-void query_enc_song(std::string song_name) {
+// forward declaration, query_pages reloads song metadata
+int load_enc_metadata(std::string song_name, volatile encryptedMetadata *metadata);
+
+// runs a player or song query a page at a time, from the users already in users on,
+// until it has every user name
+// song queries reload the metadata for each page, the query results overwrite it
+// returns false if the song could not be read
+bool query_pages(int opcode, std::string song_name, queryStruct *q, std::vector<std::string> &users) {
+	do {
+		if (opcode == QUERY_ENC_SONG) {
+			int size = load_enc_metadata(song_name, &c->encMetadata);
+			if (size < 0) {
+				return false;
+			}
+			c->metadata_size = size;
+		}
+		c->query_offset = users.size();
+
+		// drive DRM
+		send_command(opcode);
+		while (c->drm_state == STOPPED) continue; // wait for DRM to start working
+		while (c->drm_state == WORKING) continue; // wait for DRM to fill the page
+
+		snapshot_query(q, shm_field(c, cmd_channel, query), users);
+	} while (q->page_users && users.size() < q->num_users);
+
+	return true;
+}
+
+// queries the DRM about the player
+// DRM will fill shared buffer with query content
+void query_player() {
+    queryStruct query;
+    std::vector<std::string> users;
+
+    query_pages(QUERY_PLAYER, "", &query, users);
+
+    // print query results
+    print_player_query(&query, users);
+}
+
+// loads the encrypted metadata of a song into the given shared buffer
+// returns the plaintext size of the metadata, -1 if the song could not be read
+int load_enc_metadata(std::string song_name, volatile encryptedMetadata *metadata) {
 	FILE *fd;
 
 	char encryptedMetadataBuffer[ENC_METADATA_SZ];
+	uint32_t size;
 
 	// Open the file in read(byte) mode
 	fd = fopen(song_name.c_str(), "rb");
 
 	if (fd == NULL) {
-		mp_print("Could not open " , song_name , " to share:" , (errno) , "\r\n");
-		return;
+		mp_print("Could not open " , song_name , ":" , (errno) , "\r\n");
+		return -1;
 	}
 
 	// Seek past the wave header
-	fseek(fd, sizeof(encryptedWaveheader), SEEK_SET);
+	size = song_metadata_size(fd);
+	fseek(fd, enc_header_size(fd), SEEK_SET);
 
 	// Read the encrypted metadata into the buffer
-	fread(encryptedMetadataBuffer, ENC_METADATA_SZ, 1, fd);
+	fread(encryptedMetadataBuffer, NONCE_SIZE + MAC_SIZE + size, 1, fd);
+	fclose(fd);
 
-	memcpy((encryptedMetadata *)&c->encMetadata, encryptedMetadataBuffer, ENC_METADATA_SZ);
+	shm_commit(metadata, encryptedMetadataBuffer, NONCE_SIZE + MAC_SIZE + size);
 
-	// drive DRM
-	send_command(QUERY_ENC_SONG);
-	while (c->drm_state == STOPPED) {
-		continue;
-	}
-	while (c->drm_state == WORKING) {
-		continue; // wait for DRM to finish
-	}
+	return size;
+}
 
-	// print query results
-	mp_print( "Owner: " , (unsigned char *) c->query.owner , "\r\n");
+// prints the results of a song query, from a snapshot and all of its user names
+void print_song_query(const queryStruct *q, const std::vector<std::string> &users) {
+	mp_print( "Owner: " , (unsigned char *) q->owner , "\r\n");
 
-	std::string buffer((char *)q_region_lookup(c->query, 0));
+	std::string buffer((char *)q_region_lookup((*q), 0));
 
 	mp_print( "Regions: " , buffer);
 
-	for (unsigned int i = 1; i < c->query.num_regions; i++) {
-		buffer = std::string((char *)q_region_lookup(c->query, i));
+	for (unsigned int i = 1; i < q->num_regions; i++) {
+		buffer = std::string((char *)q_region_lookup((*q), i));
 		std::cout << ", " << buffer;
 	}
 	std::cout << "\r\n";
 
-	buffer = std::string((char *)c->query.owner);
+	buffer = std::string((char *)q->owner);
 	mp_print( "Owner: " , buffer , "\r\n");
 
 	mp_print( "Authorized users: ");
-	if (c->query.num_users) {
-		buffer = std::string((char *)q_user_lookup(c->query, 0));
-		std::cout << buffer;
-		for (unsigned int i = 1; i < c->query.num_users; i++) {
-			buffer = std::string((char *)q_user_lookup(c->query, i));
-			std::cout << ", " << buffer;
-		}
+	print_query_users(users);
+}
+
+//Queries metadata of encrypted song and prints information from metadata
+void query_enc_song(std::string song_name) {
+	queryStruct query;
+	std::vector<std::string> users;
+
+	if (!query_pages(QUERY_ENC_SONG, song_name, &query, users)) {
+		return;
 	}
-	std::cout << "\r\n";
+
+	// print query results
+	print_song_query(&query, users);
 }
 
 // turns DRM song into original WAV for digital output
@@ -396,13 +750,18 @@ void digital_out(std::string song_name) {
 	while (c->drm_state == STOPPED) continue;
 	while (c->drm_state == WORKING) continue;
 
+	chunk_reader chunks = { rfp, NULL, {}, {}, 0 };
+
 	if (c->drm_state == WAITING_METADATA) {
 		// Copy decrypted metadata to new file
-		fwrite((unsigned char *)c->wav_header, WAVE_HEADER_SZ, 1, wfp);
+		unsigned char wav_header[WAVE_HEADER_SZ];
+		shm_snapshot(wav_header, c->wav_header, WAVE_HEADER_SZ);
+		fwrite(wav_header, WAVE_HEADER_SZ, 1, wfp);
 
 		int metadata_size = c->metadata_size;
 		read_enc_metadata(rfp, metadata_size);
 		mp_print( "Metadata read!" , "\r\n");
+		open_chunks(chunks, song_name);
 	}
 
 	while (c->drm_state == WAITING_METADATA) {
@@ -414,18 +773,22 @@ void digital_out(std::string song_name) {
 	// Initialize a buffer before playing
 	for (int i = 0; i < ENC_BUFFER_SZ; i++) {
 		int chunk_size = c->chunk_size;
-		read_enc_chunk(rfp, chunk_size, i);
+		read_next_chunk(chunks, chunk_size, i);
 	}
 	send_command(READ_CHUNK);
 
 	int total_chunks_written = 0;
+	static unsigned char chunk[SONG_CHUNK_SZ];
 
 	while (1) {
 		while (c->drm_state == WAITING_CHUNK) {
 			// Read decrypted chunks from buffer
 			for (int i = 0; i < ENC_BUFFER_SZ / 2; i++) {
 				int buffer_loc = i + ((ENC_BUFFER_SZ / 2) * c->buffer_offset);
-				fwrite((unsigned char *) &c->songBuffer[SONG_CHUNK_SZ * buffer_loc], SONG_CHUNK_SZ, 1, wfp);
+				// Slots keep the largest chunk size, the song may use less of each
+				int chunk_size = c->chunk_size;
+				shm_snapshot(chunk, &c->songBuffer[SONG_CHUNK_SZ * buffer_loc], chunk_size);
+				fwrite(chunk, chunk_size, 1, wfp);
 				total_chunks_written++;
 			}
 
@@ -436,7 +799,7 @@ void digital_out(std::string song_name) {
 				// Check for offset
 				int buffer_loc = i + ((ENC_BUFFER_SZ / 2) * c->buffer_offset);
 
-				read_enc_chunk(rfp, chunk_size, buffer_loc);
+				read_next_chunk(chunks, chunk_size, buffer_loc);
 			}
 
 			send_command(READ_CHUNK);
@@ -449,18 +812,21 @@ void digital_out(std::string song_name) {
 			// Read out last buffer
 			// buffer offset doesn't get toggled before the song finished decrypting its last buffer
 
-			// Account for uneven
-			int last_chunks = (c->total_chunks % (ENC_BUFFER_SZ / 2) == 0) ? ENC_BUFFER_SZ / 2 : c->total_chunks % (ENC_BUFFER_SZ / 2);
+			// Account for uneven, total_chunks does not count the remainder chunk
+			int song_chunks = c->total_chunks + 1;
+			int last_chunks = (song_chunks % (ENC_BUFFER_SZ / 2) == 0) ? ENC_BUFFER_SZ / 2 : song_chunks % (ENC_BUFFER_SZ / 2);
 			for (int i = 0; i < last_chunks; i++) {
 				int buffer_loc = i + ((ENC_BUFFER_SZ / 2) * !c->buffer_offset);
 
+				int chunk_size = c->chunk_size;
 				if (i == last_chunks - 1) {
 					mp_print( "Writing last chunk!" , "\r\n");
-					fwrite((unsigned char *) &c->songBuffer[SONG_CHUNK_SZ * buffer_loc], c->chunk_remainder, 1, wfp);
-				} else {
-					fwrite((unsigned char *) &c->songBuffer[SONG_CHUNK_SZ * buffer_loc], SONG_CHUNK_SZ, 1, wfp);
+					chunk_size = c->chunk_remainder;
 				}
 
+				shm_snapshot(chunk, &c->songBuffer[SONG_CHUNK_SZ * buffer_loc], chunk_size);
+				fwrite(chunk, chunk_size, 1, wfp);
+
 				total_chunks_written++;
 			}
 			break;
@@ -470,26 +836,16 @@ void digital_out(std::string song_name) {
 	mp_print( "Song dump finished" , "\r\n");
 
 	fclose(wfp);
+	close_chunks(chunks);
 	fclose(rfp);
 	return;
 
 }
 
-// attempts to share a song with a user
-void share_enc_song(std::string& song_name, std::string& username) {
-	mp_print( "Attempting to share " , song_name , " with " , username , "\r\n");
+// rewrites a song file with the re-encrypted metadata returned by the DRM
+void write_shared_song(std::string& song_name, volatile encryptedMetadata *metadata) {
 	FILE *fd;
 
-	if (username.empty()) {
-		mp_print( "Need song name and username\r\n");
-		print_help();
-		return;
-	}
-
-	// Create a buffer for the read metadata
-	char encryptedMetadataBuffer[ENC_METADATA_SZ];
-
-	// Open the file in read(byte) mode
 	fd = fopen(song_name.c_str(), "rb");
 
 	if (fd == NULL) {
@@ -497,33 +853,6 @@ void share_enc_song(std::string& song_name, std::string& username) {
 		return;
 	}
 
-	fseek(fd, ENC_WAVE_HEADER_SZ + META_DATA_ALLOC, SEEK_SET);
-
-	// Read the encrypted metadata into the buffer
-	fread(encryptedMetadataBuffer, ENC_METADATA_SZ, 1, fd);
-
-	// Copy the local buffer to the command buffer
-	memcpy((encryptedMetadata *)&c->encMetadata, encryptedMetadataBuffer, ENC_METADATA_SZ);
-
-	// Check username argument
-	if (username.empty()) {
-		mp_print( "Need song name and username\r\n");
-		print_help();
-	}
-
-	username.copy((char *) c->username, USERNAME_SZ, 0);
-
-	// drive DRM
-	send_command(ENC_SHARE);
-	while (c->drm_state == STOPPED) continue; // wait for DRM to start working
-	while (c->drm_state == WORKING) continue; // wait for DRM to start working
-
-	// Check if the share was rejected
-	if (c->share_rejected == 1) {
-		mp_print("Share rejected\r\n");
-		return;
-	}
-
 	// Get file size
 	fseek(fd, 0, SEEK_END);
 	int endFileSZ = ftell(fd);
@@ -538,27 +867,32 @@ void share_enc_song(std::string& song_name, std::string& username) {
 
 	if (fd2 == NULL) {
 		mp_print("Failed to open file! Error = " , (errno) , "\r\n");
+		fclose(fd);
 		return;
 	}
 
 	// Max size it will be, ENC_METADATA_SZ
 	char buffer[ENC_METADATA_SZ];
 
-	// Read WAVE_HEADER
-	fread(buffer, ENC_WAVE_HEADER_SZ + META_DATA_ALLOC, 1, fd);
+	// Read WAVE_HEADER, v2 songs carry their prefix along with it
+	long header_size = enc_header_size(fd);
+	long enc_metadata_size = NONCE_SIZE + MAC_SIZE + song_metadata_size(fd);
+	fread(buffer, header_size, 1, fd);
 
 	// Write WAVE_HEADER
-	fwrite(buffer, ENC_WAVE_HEADER_SZ + META_DATA_ALLOC, 1, fd2);
+	fwrite(buffer, header_size, 1, fd2);
 
 	// Seek past metadata
-	fseek(fd, ENC_METADATA_SZ, SEEK_CUR);
+	fseek(fd, enc_metadata_size, SEEK_CUR);
 
-	// Write new metadata
-	fwrite((encryptedMetadata *)&c->encMetadata, ENC_METADATA_SZ, 1, fd2);
+	// Write new metadata, the DRM keeps the size the song came with
+	encryptedMetadata new_metadata;
+	shm_snapshot(&new_metadata, metadata, enc_metadata_size);
+	fwrite(&new_metadata, enc_metadata_size, 1, fd2);
 
 	static unsigned char song_buffer[MAX_SONG_SZ];
 
-	int byte_to_read = endFileSZ - (ENC_WAVE_HEADER_SZ + META_DATA_ALLOC + ENC_METADATA_SZ);
+	int byte_to_read = endFileSZ - (header_size + enc_metadata_size);
 	mp_print( "Size of song_buffer: " , sizeof(song_buffer) , "\r\n");
 	mp_print( "file size: " , endFileSZ , "\r\n");
 	mp_print( "Bytes to read: " , byte_to_read , "\r\n");
@@ -583,6 +917,222 @@ void share_enc_song(std::string& song_name, std::string& username) {
 	return;
 }
 
+// attempts to share a song with a user
+void share_enc_song(std::string& song_name, std::string& username) {
+	mp_print( "Attempting to share " , song_name , " with " , username , "\r\n");
+
+	if (username.empty()) {
+		mp_print( "Need song name and username\r\n");
+		print_help();
+		return;
+	}
+
+	// Copy the encrypted metadata to the command buffer
+	int size = load_enc_metadata(song_name, &c->encMetadata);
+	if (size < 0) {
+		return;
+	}
+	c->metadata_size = size;
+
+	char target[USERNAME_SZ] = {0};
+	username.copy(target, USERNAME_SZ, 0);
+	shm_commit(c->username, target, USERNAME_SZ);
+
+	// drive DRM
+	send_command(ENC_SHARE);
+	while (c->drm_state == STOPPED) continue; // wait for DRM to start working
+	while (c->drm_state == WORKING) continue; // wait for DRM to start working
+
+	// Check if the share was rejected
+	if (c->share_rejected == 1) {
+		mp_print("Share rejected\r\n");
+		return;
+	}
+
+	write_shared_song(song_name, &c->encMetadata);
+}
+
+// fetches, prints and resets the DRM playback counters
+void print_stats() {
+	// drive DRM
+	send_command(STATS);
+	while (c->drm_state == STOPPED) continue; // wait for DRM to start working
+	while (c->drm_state == WORKING) continue; // wait for DRM to publish
+
+	telemetry t;
+	shm_snapshot(&t, &c->stats, sizeof(telemetry));
+
+	mp_print("DRM telemetry since last reset:\r\n");
+	std::cout << "  chunks verified: " << t.chunks_verified << "\r\n";
+	std::cout << "  refill requests: " << t.refill_waits << "\r\n";
+	std::cout << "  underruns: " << t.underruns << "\r\n";
+	std::cout << "  silence slices inserted: " << t.silence_frames << "\r\n";
+	if (t.fifo_low_water == 0xFFFFFFFF) {
+		std::cout << "  FIFO low water: n/a\r\n";
+	} else {
+		std::cout << "  FIFO low water: " << t.fifo_low_water << "\r\n";
+	}
+	std::cout << "  DMA busy waits: " << t.dma_waits << "\r\n";
+	std::cout << "  metadata cache hits: " << t.md_cache_hits << " of " << t.md_cache_hits + t.md_cache_misses << "\r\n";
+	std::cout << "  idle sleeps: " << t.idle_sleeps << "\r\n";
+	std::cout << "  idle polling spins: " << t.idle_spins << "\r\n";
+	std::cout << "  state changes: " << t.state_changes << " (LED updates: " << t.led_updates << ")\r\n";
+	std::cout << "  waits woken by an interrupt: " << t.wakeups << "\r\n";
+}
+
+// consumes the completions posted by the DRM for a batch
+// song_names holds the song each queue slot was submitted for
+void drain_completions(std::string song_names[CMD_QUEUE_SZ]) {
+	volatile cmd_queue *q = &c->queue;
+
+	while (q->cq_head != q->cq_tail) {
+		uint8_t slot = q->cq[queue_slot(q->cq_head)];
+		volatile cmd_queue_entry *e = &q->entries[slot];
+		bool ok = (e->status == QUEUE_DONE);
+		queryStruct query;
+		std::vector<std::string> users;
+
+		mp_print("[", (unsigned int) e->seq, "] ");
+		switch (e->opcode) {
+		case LOGIN:
+			std::cout << (ok ? "Logged in\r\n" : "Login failed\r\n");
+			break;
+		case LOGOUT:
+			std::cout << (ok ? "Logged out\r\n" : "Not logged in\r\n");
+			break;
+		case QUERY_PLAYER:
+			std::cout << "Player:\r\n";
+			snapshot_query(&query, shm_field(e, cmd_queue_entry, query), users);
+			if (query.page_users && users.size() < query.num_users) {
+				query_pages(QUERY_PLAYER, "", &query, users);
+			}
+			print_player_query(&query, users);
+			break;
+		case QUERY_ENC_SONG:
+			std::cout << song_names[slot] << "\r\n";
+			if (ok) {
+				snapshot_query(&query, shm_field(e, cmd_queue_entry, query), users);
+				// the entry holds the first page, the rest come from direct queries of the song file
+				if (query.page_users && users.size() < query.num_users) {
+					query_pages(QUERY_ENC_SONG, song_names[slot], &query, users);
+				}
+				print_song_query(&query, users);
+			} else {
+				mp_print("Query failed\r\n");
+			}
+			break;
+		case ENC_SHARE:
+			std::cout << song_names[slot] << "\r\n";
+			if (ok) {
+				write_shared_song(song_names[slot], &e->metadata);
+			} else {
+				mp_print("Share rejected\r\n");
+			}
+			break;
+		default:
+			std::cout << "Unsupported command\r\n";
+			break;
+		}
+
+		e->status = QUEUE_EMPTY;
+		q->cq_head++;
+	}
+}
+
+// runs a script of login/logout/query/share commands with one DRM interrupt
+// per CMD_QUEUE_SZ commands instead of one per command
+// queued entries read the song file as it is when they are queued, so the queue
+// is flushed before a song with a share still pending is read again
+void run_batch(std::string script_name) {
+	std::ifstream script(script_name);
+	std::string line, cmd, arg1, arg2;
+	std::string song_names[CMD_QUEUE_SZ];
+	std::set<std::string> pending_shares;
+	volatile cmd_queue_entry *e;
+
+	if (!script.is_open()) {
+		mp_print("Could not open ", script_name, "\r\n");
+		return;
+	}
+
+	while (std::getline(script, line)) {
+		cmd = arg1 = arg2 = "";
+		parse_input(line, cmd, arg1, arg2);
+
+		if (cmd.empty() || cmd[0] == '#') {
+			continue;
+		}
+
+		int opcode;
+		if (cmd == "login") {
+			if (!valid_credentials(arg1, arg2)) continue;
+			opcode = LOGIN;
+		} else if (cmd == "logout") {
+			opcode = LOGOUT;
+		} else if (cmd == "query_player") {
+			opcode = QUERY_PLAYER;
+		} else if (cmd == "query") {
+			opcode = QUERY_ENC_SONG;
+		} else if (cmd == "share") {
+			if (arg2.empty()) {
+				mp_print("Need song name and username\r\n");
+				continue;
+			}
+			opcode = ENC_SHARE;
+		} else {
+			mp_print("Cannot batch '", cmd, "'\r\n");
+			continue;
+		}
+
+		// the pending share rewrites the song when it completes
+		if ((opcode == QUERY_ENC_SONG || opcode == ENC_SHARE) && pending_shares.count(arg1)) {
+			submit_queue();
+			drain_completions(song_names);
+			pending_shares.clear();
+		}
+
+		// flush a full queue before reserving another entry
+		if ((e = queue_command(opcode)) == NULL) {
+			submit_queue();
+			drain_completions(song_names);
+			pending_shares.clear();
+			if ((e = queue_command(opcode)) == NULL) {
+				mp_print("Command queue is stuck, stopping the batch\r\n");
+				return;
+			}
+		}
+
+		if (opcode == ENC_SHARE) {
+			pending_shares.insert(arg1);
+		}
+
+		uint8_t slot = queue_slot(e->seq);
+		song_names[slot] = arg1;
+
+		char credentials[USERNAME_SZ + MAX_PIN_SZ] = {0};
+		if (opcode == LOGIN) {
+			strncpy(credentials, arg1.c_str(), USERNAME_SZ);
+			strncpy(credentials + USERNAME_SZ, arg2.c_str(), MAX_PIN_SZ);
+		} else if (opcode == ENC_SHARE) {
+			strncpy(credentials, arg2.c_str(), USERNAME_SZ);
+		}
+		shm_commit(e->username, credentials, sizeof(credentials));
+
+		if (opcode == QUERY_ENC_SONG || opcode == ENC_SHARE) {
+			int size = load_enc_metadata(arg1, &e->metadata);
+			if (size < 0) {
+				// leave the entry for the DRM to reject so completions stay in order
+				shm_clear(&e->metadata, sizeof(encryptedMetadata));
+				size = METADATA_SZ;
+			}
+			e->metadata_size = size;
+		}
+	}
+
+	submit_queue();
+	drain_completions(song_names);
+}
+
 //Outputs the audio content of the encrypted song
 void play_encrypted_song(std::string song_name) {
 
@@ -669,13 +1219,29 @@ int main(int argc, char** argv) {
 
 
 	// open command channel
+#ifdef MIPOD_SIM
+	const char *ddr = getenv("MIPOD_SIM_DDR");
+	mem = open(ddr ? ddr : "ddr.bin", O_RDWR);
+	c = (cmd_channel*) mmap(NULL, sizeof(cmd_channel), PROT_READ | PROT_WRITE, MAP_SHARED, mem, SIM_CHANNEL_OFFSET);
+	doorbell = (uint32_t*) mmap(NULL, sysconf(_SC_PAGESIZE), PROT_READ | PROT_WRITE, MAP_SHARED, mem, SIM_DOORBELL_OFFSET);
+	if (doorbell == MAP_FAILED) {
+		mp_print("MMAP Failed! Error = " , (errno));
+		return -1;
+	}
+#else
 	mem = open("/dev/uio0", O_RDWR);
 	c = (cmd_channel*) mmap(NULL, sizeof(cmd_channel), PROT_READ | PROT_WRITE, MAP_SHARED, mem, 0);
+#endif
 	if (c == MAP_FAILED) {
 		mp_print("MMAP Failed! Error = " , (errno));
 		return -1;
 	}
 
+	// print DRM log messages in the background
+	pthread_t lthread;
+	pthread_create(&lthread, NULL, log_thread, NULL);
+	pthread_detach(lthread);
+
 	// dump player information before command loop
 	query_player();
 
@@ -703,6 +1269,10 @@ int main(int argc, char** argv) {
 				share_enc_song(arg1, arg2);
 			} else if (cmd == "play") {
 				play_encrypted_song(arg1);
+			} else if (cmd == "batch") {
+				run_batch(arg1);
+			} else if (cmd == "stats") {
+				print_stats();
 			} else if (cmd == "exit") {
 				mp_print( "Exiting..." , "\r\n");
 				break;
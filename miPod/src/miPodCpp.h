@@ -14,15 +14,17 @@
 #define USR_CMD_SZ 64
 
 // protocol constants
-#define MAX_REGIONS 32
+#define MAX_REGIONS 64                  // regions and users of a deployment, the bits of compact metadata
 #define REGION_NAME_SZ 16
-#define MAX_USERS 64
+#define MAX_USERS 2048
 #define USERNAME_SZ 16
+#define QUERY_PAGE_USERS 64             // user names returned by one query, the rest are fetched a page at a time
 #define MAX_PIN_SZ 8
 #define MAX_SONG_SZ (1<<25)
 
-#define HASHPIN_SZ 32
-#define SALT_SZ 7
+// id lists of a purdue_md
+#define PURDUE_MD_REGIONS 32
+#define PURDUE_MD_USERS 64
 
 // printing utility
 #define MP_PROMPT "MP> "
@@ -32,47 +34,54 @@
 #define print_prompt() printf(USER_PROMPT, "")
 #define print_prompt_msg(...) printf(USER_PROMPT, __VA_ARGS__)
 
+// DRM log levels, lower is more severe (matches the DRM)
+#define LOG_ERROR 0
+#define LOG_WARN 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+
+// DRM log ring constants (size must be a power of two, matches the DRM)
+#define LOG_RING_SZ 4096
+#define LOG_MSG_SZ 120
+#define log_pos(n) ((n) & (LOG_RING_SZ - 1))
+#define LOG_POLL_US 10000
+
 #define AUDIO_SAMPLING_RATE 48000
 #define BYTES_PER_SAMP 2
 #define NONCE_SIZE 12
 #define MAC_SIZE 16
 #define WAVE_HEADER_SZ 44
-#define METADATA_SZ 390
+#define METADATA_SZ 390 + SHA_256_SUM_SZ
 #define ENC_WAVE_HEADER_SZ WAVE_HEADER_SZ + NONCE_SIZE + MAC_SIZE
 #define ENC_METADATA_SZ METADATA_SZ + NONCE_SIZE + MAC_SIZE
+#define COMPACT_MD_SZ 304 // compact metadata of songs with SONG_FLAG_COMPACT_METADATA, sizeof(compact_md) in the DRM
 #define META_DATA_ALLOC 4
-#define SONG_CHUNK_SZ 16000
+#define SONG_CHUNK_SZ 16000 // v1 chunk size and the largest chunk a v2 song may use
 #define ENC_BUFFER_SZ 60
 #define SHA_256_SUM_SZ 32
 
-// structs to import secrets.h JSON data into memory
-typedef struct {
-    uint32_t uid;
-    char username[USERNAME_SZ];
-    char hashedPin[HASHPIN_SZ];
-    char salt[SALT_SZ];
-} user_struct;
-
-typedef struct {
-    uint32_t regionID;
-    char regionName[REGION_NAME_SZ];
-} region_struct;
-
-typedef struct {
-    uint32_t provisioned_userID;
-} provisioned_user_struct;
+// protected song format, v2 files start with a plaintext prefix, v1 files with the header nonce
+#define DRM_MAGIC "DRMSONG"
+#define DRM_MAGIC_SZ 8
+#define DRM_FORMAT_V2 2
+#define SONG_FLAG_MERKLE_ROOT (1 << 1)      // header carries a merkle root, 32 bytes longer
+#define SONG_FLAG_COMPACT_METADATA (1 << 2) // metadata is COMPACT_MD_SZ bytes rather than METADATA_SZ
+#define SONG_FLAG_HEADER_HASH (1 << 3)      // header carries the song hash and nonce prefix, 40 bytes longer
+#define NONCE_PREFIX_SZ 8
 
-typedef struct {
-    uint32_t provisioned_regionID;
-} provisioned_region_struct;
+// command queue constants (must be a power of two, matches the DRM)
+#define CMD_QUEUE_SZ 16
+#define queue_slot(n) ((n) & (CMD_QUEUE_SZ - 1))
 
 // struct to interpret shared buffer as a query
+// users holds one page of the user names, starting at the query offset
 typedef struct {
 	uint32_t num_regions;
-	uint32_t num_users;
+	uint32_t num_users;			// users of the player or song, over all pages
+	uint32_t page_users;		// user names in this page
     char owner[USERNAME_SZ];
     char regions[MAX_REGIONS * REGION_NAME_SZ];
-    char users[MAX_USERS * USERNAME_SZ];
+    char users[QUERY_PAGE_USERS * USERNAME_SZ];
 } queryStruct;
 
 // simulate array of 64B names without pointer indirection
@@ -84,8 +93,8 @@ typedef struct __attribute__ ((__packed__)) {
     uint32_t owner_id;
     uint8_t num_regions;
     uint8_t num_users;
-    uint32_t provisioned_regions[MAX_REGIONS];
-    uint32_t provisioned_users[MAX_USERS];
+    uint32_t provisioned_regions[PURDUE_MD_REGIONS];
+    uint32_t provisioned_users[PURDUE_MD_USERS];
 } purdue_md;
 
 typedef struct __attribute__ ((__packed__)) {
@@ -99,6 +108,56 @@ typedef struct __attribute__ ((__packed__)) {
 	unsigned char tag[MAC_SIZE];
 } encryptedWaveheader;
 
+// plaintext start of a v2 song, authenticated as part of the header aad
+typedef struct __attribute__ ((__packed__)) {
+	char magic[DRM_MAGIC_SZ];
+	uint32_t version;
+	uint32_t flags;
+} songPrefix;
+
+// v2 header, encrypted on disk, only the DRM can read it
+typedef struct __attribute__ ((__packed__)) {
+	unsigned char wav_header[WAVE_HEADER_SZ];
+	uint32_t metadata_size;
+	uint32_t chunk_size;
+	uint32_t num_chunks;
+	uint32_t index_offset;
+	unsigned char merkle_root[SHA_256_SUM_SZ];  // only present with SONG_FLAG_MERKLE_ROOT
+	unsigned char sha256sum[SHA_256_SUM_SZ];    // only present with SONG_FLAG_HEADER_HASH
+	unsigned char nonce_prefix[NONCE_PREFIX_SZ];
+} songHeaderStruct;
+
+typedef struct __attribute__ ((__packed__)) {
+	songPrefix prefix;
+	unsigned char nonce[NONCE_SIZE];
+	songHeaderStruct header;
+	unsigned char tag[MAC_SIZE];
+} encryptedSongHeader;
+
+// plaintext chunk offsets after the last chunk of a v2 song, authenticated by the tools
+typedef struct __attribute__ ((__packed__)) {
+	unsigned char nonce[NONCE_SIZE];
+	unsigned char tag[MAC_SIZE];
+} songIndexHeader;
+
+// stored songs (tools/storeSongs) keep their chunks in a store shared by the library,
+// the song file holds everything up to the first chunk and then a manifest
+#define STORE_NAME "chunks.store"
+#define MANIFEST_MAGIC "DRMLIST"
+#define STORE_VERSION 1
+
+typedef struct __attribute__ ((__packed__)) {
+	char magic[DRM_MAGIC_SZ];
+	uint32_t version;
+	uint32_t num_chunks;
+} manifestHeader;
+
+// where a chunk's nonce and ciphertext sit in the store, the tag is kept per song
+typedef struct __attribute__ ((__packed__)) {
+	uint32_t offset;
+	unsigned char tag[MAC_SIZE];
+} storedChunk;
+
 typedef struct __attribute__ ((__packed__)) {
 	unsigned char nonce[NONCE_SIZE];
 	unsigned char tag[MAC_SIZE];
@@ -115,6 +174,57 @@ typedef struct __attribute__ ((__packed__)) {
 
 #define get_chunk_data(c) ((char *)(&c.data))
 
+// playback counters, published into the command channel on a STATS command
+typedef struct __attribute__ ((__packed__)) {
+	uint32_t chunks_verified;	// chunks that passed their Poly1305 check
+	uint32_t dma_waits;			// copies that had to wait for the DMA to go idle
+	uint32_t fifo_low_water;	// lowest FIFO fill level seen while playing
+	uint32_t refill_waits;		// chunk refills requested from miPod
+	uint32_t underruns;			// times the FIFO was found empty while playing
+	uint32_t silence_frames;	// silence slices queued to ride out a late refill
+	uint32_t md_cache_hits;		// metadata records answered from the verified cache
+	uint32_t md_cache_misses;	// metadata records that went through the AEAD
+	uint32_t idle_sleeps;		// times the core slept waiting for an interrupt
+	uint64_t idle_spins;		// polling loop iterations while waiting, the idle power proxy
+	uint32_t wakeups;		// interrupt wakes of a waiting loop
+	uint32_t state_changes;		// DRM state transitions published to miPod
+	uint32_t led_updates;		// LED colors written to the PWM
+} telemetry;
+
+// DRM log messages waiting to be printed, each stored as level, length and text
+// counters are free running byte offsets and wrap through log_pos()
+typedef struct __attribute__ ((__packed__)) {
+	uint32_t head;				// next byte the DRM will write
+	uint32_t tail;				// next byte miPod will read
+	uint32_t dropped;			// messages lost because the ring was full
+	char buf[LOG_RING_SZ];
+} log_ring;
+
+// single operation of a batched command submission
+typedef struct __attribute__ ((__packed__)) {
+	uint8_t opcode;				// from commands enum
+	uint8_t status;				// from queue_states enum
+	uint16_t seq;				// submission number, echoed back by the DRM
+	uint32_t result;			// command specific result
+	uint32_t query_offset;		// first user name a query returns
+	char username[USERNAME_SZ];	// login username or share target
+	char pin[MAX_PIN_SZ];		// login pin
+	queryStruct query;			// query results, one page of users
+	encryptedMetadata metadata;	// song metadata for query/share
+	uint16_t metadata_size;		// plaintext size of metadata, METADATA_SZ or COMPACT_MD_SZ
+} cmd_queue_entry;
+
+// submission/completion queue pair, drained by the DRM on each BATCH command
+// counters are free running and wrap through queue_slot()
+typedef struct __attribute__ ((__packed__)) {
+	uint32_t sq_head;			// next submission the DRM will consume
+	uint32_t sq_tail;			// next submission miPod will write
+	uint32_t cq_head;			// next completion miPod will consume
+	uint32_t cq_tail;			// next completion the DRM will write
+	uint8_t cq[CMD_QUEUE_SZ];	// completed entry slots, in completion order
+	cmd_queue_entry entries[CMD_QUEUE_SZ];
+} cmd_queue;
+
 // accessors for variable-length metadata fields
 #define get_drm_rids(d) (d.md.buf)
 #define get_drm_uids(d) (d.md.buf + d.md.num_regions)
@@ -122,8 +232,9 @@ typedef struct __attribute__ ((__packed__)) {
 
 // TODO: Remove deprecated commands
 // shared buffer values
-enum commands { QUERY_PLAYER, QUERY_SONG, LOGIN, LOGOUT, SHARE, PLAY, STOP, DIGITAL_OUT, PAUSE, RESTART, FF, RW, PLAY_SONG, READ_HEADER, READ_METADATA, WAIT_FOR_CHUNK, READ_CHUNK, ENC_SHARE, QUERY_ENC_SONG };
+enum commands { QUERY_PLAYER, QUERY_SONG, LOGIN, LOGOUT, SHARE, PLAY, STOP, DIGITAL_OUT, PAUSE, RESTART, FF, RW, PLAY_SONG, READ_HEADER, READ_METADATA, WAIT_FOR_CHUNK, READ_CHUNK, ENC_SHARE, QUERY_ENC_SONG, BATCH, STATS };
 enum states   { STOPPED, WORKING, PLAYING, PAUSED, WAITING_FILE_HEADER, WAITING_METADATA, WAITING_CHUNK, READING_CHUNK };
+enum queue_states { QUEUE_EMPTY, QUEUE_SUBMITTED, QUEUE_DONE, QUEUE_FAILED };
 
 
 // struct to interpret shared command channel
@@ -140,7 +251,16 @@ typedef volatile struct __attribute__((__packed__)) {
     uint32_t chunk_nums;
     uint32_t chunk_remainder;
     uint32_t buffer_offset;		// Determines if reading/writing to buffer
+    uint32_t refill_request;	// refills requested by the DRM, free running
+    uint32_t refill_complete;	// last refill miPod finished
+    uint32_t refill_progress;	// chunks of the current refill already in songBuffer
+    uint32_t refill_urgent;		// set by the DRM while the audio FIFO is starving
+    uint32_t index_offset;		// file offset of the chunk index of a v2 song, 0 for v1
+    uint32_t query_offset;		// first user name a query returns, outside the union as it overlaps the metadata
     unsigned char wav_header[WAVE_HEADER_SZ];
+    telemetry stats;			// DRM counters, valid after a STATS command
+    log_ring log;				// DRM log messages, drained by the log thread
+    cmd_queue queue;			// batched commands, outside the union so other commands leave its counters alone
     unsigned char songBuffer[ENC_BUFFER_SZ * SONG_CHUNK_SZ];
 
     // shared buffer is either a drm song or a query
@@ -150,9 +270,11 @@ typedef volatile struct __attribute__((__packed__)) {
 
         // Encrypted
         encryptedWaveheader encWaveHeader;
+        encryptedSongHeader encSongHeader;
         encryptedMetadata encMetadata;
         encryptedSongChunk encSongChunk;
         encryptedSongChunk encSongBuffer[ENC_BUFFER_SZ];
+
         char buf[MAX_SONG_SZ]; // sets correct size of cmd_channel for allocation
     };
 } cmd_channel;
@@ -0,0 +1,89 @@
+/*
+ * shm.h
+ *
+ * Access layer for the shared command channel. The channel is mapped
+ * uncached, so every access is its own bus transaction; structs are copied
+ * in and out a word at a time with one barrier and worked on locally.
+ * Only the shared side is kept word aligned.
+ */
+
+#ifndef SRC_SHM_H_
+#define SRC_SHM_H_
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+
+// address of a member of a packed shared struct, without taking the address of
+// the member itself (which may be unaligned for its type)
+#define shm_field(p, type, member) \
+	((const volatile void *) ((const volatile uint8_t *) (p) + offsetof(type, member)))
+
+// copies len bytes out of shared memory into a local buffer
+static inline void shm_snapshot(void *dst, const volatile void *src, size_t len) {
+	const volatile uint8_t *s = (const volatile uint8_t *) src;
+	uint8_t *d = (uint8_t *) dst;
+
+	__sync_synchronize();
+
+	// bytes up to the first shared word boundary
+	while (len && ((uintptr_t) s & 3)) {
+		*d++ = *s++;
+		len--;
+	}
+
+	for (; len >= 4; len -= 4, s += 4, d += 4) {
+		uint32_t w = *(const volatile uint32_t *) s;
+		memcpy(d, &w, 4);
+	}
+
+	while (len--) {
+		*d++ = *s++;
+	}
+}
+
+// copies len bytes of a local buffer into shared memory
+static inline void shm_commit(volatile void *dst, const void *src, size_t len) {
+	volatile uint8_t *d = (volatile uint8_t *) dst;
+	const uint8_t *s = (const uint8_t *) src;
+
+	// bytes up to the first shared word boundary
+	while (len && ((uintptr_t) d & 3)) {
+		*d++ = *s++;
+		len--;
+	}
+
+	for (; len >= 4; len -= 4, s += 4, d += 4) {
+		uint32_t w;
+		memcpy(&w, s, 4);
+		*(volatile uint32_t *) d = w;
+	}
+
+	while (len--) {
+		*d++ = *s++;
+	}
+
+	__sync_synchronize();
+}
+
+// zeroes len bytes of shared memory
+static inline void shm_clear(volatile void *dst, size_t len) {
+	volatile uint8_t *d = (volatile uint8_t *) dst;
+
+	while (len && ((uintptr_t) d & 3)) {
+		*d++ = 0;
+		len--;
+	}
+
+	for (; len >= 4; len -= 4, d += 4) {
+		*(volatile uint32_t *) d = 0;
+	}
+
+	while (len--) {
+		*d++ = 0;
+	}
+
+	__sync_synchronize();
+}
+
+#endif /* SRC_SHM_H_ */
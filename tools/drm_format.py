@@ -0,0 +1,614 @@
+"""
+Description: Layout of protected song files, shared by protectSong and unprotectSong.py
+Use: Imported by the provisioning tools, not run directly
+
+Version 1 (no prefix):
+    header:   nonce(12) / enc(wave header(44), metadata size(4)) / tag(16)
+    metadata: nonce(12) / tag(16) / enc(metadata)
+    chunks:   nonce(12) / tag(16) / enc(chunk), floor(wav_size / 16000) full chunks and a remainder chunk
+
+Version 2 adds a plaintext prefix and an index of chunk offsets after the last chunk:
+    prefix:   magic(8) / version(4) / flags(4), authenticated as part of the header aad
+    header:   nonce(12) / enc(wave header(44), metadata size(4), chunk size(4), chunk count(4), index offset(4)) / tag(16)
+    metadata: as version 1
+    chunks:   as version 1, using the chunk size and count from the header (1024 to 16000 bytes)
+    index:    nonce(12) / tag(16) / file offset of every chunk record(4 each)
+The index is stored in the clear so miPod can seek without the key, its tag covers the offsets and the song hash.
+
+Chunk nonces are the first 12 bytes of the chunk hash, and the chunk aad is the song hash. With FLAG_COUNTER_NONCES
+set (v2 only) the nonce is a random per-song prefix(8) followed by the chunk number(4), and the chunk number is also
+appended to the aad so every chunk only opens at its own position.
+
+With FLAG_COMPACT_METADATA set (v2 only) the metadata is the compact form, sealed with its own aad:
+    song hash(32) / version(1) = 2 / reserved(3) / owner id(4) / region bitmap(8) / shared user bitmap(256)
+where bit i of a bitmap is entry i of the region or user secrets file. The DRM authorizes a song with a few ANDs
+against the bits of its provisioned regions and logged in user, and decrypts 304 bytes of metadata instead of 422.
+miPod learns the record size from the flag, the DRM checks the header metadata size against it.
+
+With FLAG_MERKLE_ROOT set the header also carries merkle root(32), taken over the chunk tags in order (RFC 6962 shape):
+    leaf = sha256(0x00 / chunk number(4) / tag)    node = sha256(0x01 / left / right)
+The tags are readable without the key, so the layout of the whole song is checked from 16 bytes per chunk, and any
+subset of chunks is then verified by decrypting just those chunks.
+
+With FLAG_HEADER_HASH set (needs FLAG_COUNTER_NONCES and FLAG_MERKLE_ROOT) the header ends with
+    song hash(32) / nonce prefix(8)
+and the chunk aad is the nonce prefix and chunk number instead of the song hash. No chunk needs the hash, so protectSong
+hashes the input in the same pass that encrypts it and writes the header and metadata last. The song hash in the
+metadata has to match the one in the header, which ties the metadata to the chunks as the old aad did.
+
+A library can also be deployed as one chunk store and a manifest per song (storeSongs):
+    store:    magic(8) / version(4), then entries of length(4) / nonce(12) / enc(chunk), each stored once
+    manifest: the song up to its first chunk (prefix, header, metadata), then
+              magic(8) / version(4) / chunk count(4) / per chunk: store offset of its nonce(4) / tag(16)
+Store entries are addressed by the sha256 of nonce and ciphertext. The tag stays in the manifest, since the aad (and
+so the tag) differs between songs while the ciphertext of identical hash-nonce chunks does not. miPod puts the record
+back together, so the DRM sees the same chunk records either way.
+"""
+from os import path
+from struct import pack, unpack, calcsize
+
+import nacl.bindings as b
+import nacl.exceptions as exc
+import nacl.hash
+import nacl.encoding
+
+MAGIC = b"DRMSONG\0"
+VERSION = 2
+
+NONCE_SIZE = 12
+MAC_SIZE = 16
+WAVE_HEADER_SIZE = 44
+SHA256_SIZE = 32
+
+# Plaintext metadata: song hash(32) / owner id(4) / region count(1) / user count(1) / region ids / shared user ids
+METADATA_REGIONS = 32
+METADATA_USERS = 64
+METADATA_FORMAT = "<{}sIBB{}I{}I".format(SHA256_SIZE, METADATA_REGIONS, METADATA_USERS)
+
+# Regions and users of a deployment, the DRM and compact metadata have room for this many
+MAX_REGIONS = 64
+MAX_USERS = 2048
+
+# Compact metadata: song hash(32) / version(1) / reserved(3) / owner id(4) / region bitmap / shared user bitmap
+COMPACT_VERSION = 2
+REGION_WORDS = MAX_REGIONS // 32
+USER_WORDS = MAX_USERS // 32
+COMPACT_METADATA_FORMAT = "<{}sB3xI{}I{}I".format(SHA256_SIZE, REGION_WORDS, USER_WORDS)
+CHUNK_SIZE = 16000
+
+# v2 chunk sizes the DRM accepts, chunks have to fit its 16000 byte buffers and stay word aligned
+MIN_CHUNK_SIZE = 1024
+MAX_CHUNK_SIZE = CHUNK_SIZE
+
+# v2 prefix flags
+FLAG_COUNTER_NONCES = 1 << 0
+FLAG_MERKLE_ROOT = 1 << 1
+FLAG_COMPACT_METADATA = 1 << 2
+FLAG_HEADER_HASH = 1 << 3
+KNOWN_FLAGS = FLAG_COUNTER_NONCES | FLAG_MERKLE_ROOT | FLAG_COMPACT_METADATA | FLAG_HEADER_HASH
+
+# Flags a song needs before it can carry FLAG_HEADER_HASH, the aad uses the nonce prefix and the root covers the tags
+HEADER_HASH_NEEDS = FLAG_COUNTER_NONCES | FLAG_MERKLE_ROOT
+
+# Flags protectSong sets on v2 songs
+DEFAULT_FLAGS = FLAG_COUNTER_NONCES | FLAG_MERKLE_ROOT | FLAG_COMPACT_METADATA | FLAG_HEADER_HASH
+
+NONCE_PREFIX_SIZE = 8
+
+PREFIX_FORMAT = "<8sII"
+HEADER_V1_FORMAT = "<44sI"
+HEADER_V2_FORMAT = "<44sIIII"
+MERKLE_ROOT_FORMAT = "32s"
+HEADER_HASH_FORMAT = "32s8s"
+
+PREFIX_SIZE = calcsize(PREFIX_FORMAT)
+RECORD_OVERHEAD = NONCE_SIZE + MAC_SIZE
+
+HEADER_AAD = b"wave_header\0"
+METADATA_AAD = b"meta_data\0"
+COMPACT_METADATA_AAD = b"compact_md\0"
+INDEX_AAD = b"chunk_index\0"
+
+STORE_MAGIC = b"DRMSTOR\0"
+MANIFEST_MAGIC = b"DRMLIST\0"
+STORE_VERSION = 1
+STORE_NAME = "chunks.store"
+STORE_HEADER_FORMAT = "<8sI"
+MANIFEST_HEADER_FORMAT = "<8sII"
+MANIFEST_ENTRY_FORMAT = "<I16s"
+# Offsets into the store are 32 bit, as in the chunk index
+MAX_STORE_SIZE = 1 << 32
+
+
+class FormatError(Exception):
+    """Raised when a protected song is malformed or fails a tag check, what names the failing record"""
+
+    def __init__(self, what, problem):
+        Exception.__init__(self, what + " " + problem)
+        self.what = what
+
+
+def digest(data):
+    return nacl.hash.sha256(data, encoder=nacl.encoding.RawEncoder)
+
+
+def seal(key, nonce, plaintext, aad):
+    """Returns nonce, tag and ciphertext in the order they are stored"""
+    encrypted = b.crypto_aead_chacha20poly1305_ietf_encrypt(plaintext, aad, nonce, key)
+    return nonce + encrypted[-MAC_SIZE:] + encrypted[:-MAC_SIZE]
+
+
+def seal_header(key, nonce, plaintext, aad):
+    """Returns nonce, ciphertext and tag, headers keep the tag after the ciphertext"""
+    return nonce + b.crypto_aead_chacha20poly1305_ietf_encrypt(plaintext, aad, nonce, key)
+
+
+def open_record(key, nonce, tag, ciphertext, aad, what):
+    """Returns the plaintext of a record, raising FormatError if its tag does not match"""
+    try:
+        return b.crypto_aead_chacha20poly1305_ietf_decrypt(ciphertext + tag, aad, nonce, key)
+    except exc.CryptoError:
+        raise FormatError(what, "failed its tag check")
+
+
+def check_chunk_size(version, chunk_size):
+    """Raises ValueError if a song of this version cannot use chunk_size"""
+    if version == 1 and chunk_size != CHUNK_SIZE:
+        raise ValueError("version 1 songs use {} byte chunks".format(CHUNK_SIZE))
+    if not MIN_CHUNK_SIZE <= chunk_size <= MAX_CHUNK_SIZE or chunk_size % 4:
+        raise ValueError("chunk size must be a multiple of 4 from {} to {}".format(MIN_CHUNK_SIZE, MAX_CHUNK_SIZE))
+
+
+def chunk_nonce(chunk_buffer, index, nonce_prefix=None):
+    """Returns the nonce of chunk index (0 based), from its hash or from the per-song prefix"""
+    if nonce_prefix is None:
+        return digest(chunk_buffer)[:NONCE_SIZE]
+    return nonce_prefix + pack("<I", index)
+
+
+def chunk_aad(sha256sum, index, flags, nonce_prefix=None):
+    """Returns the aad of chunk index (0 based), counter nonce songs bind the chunk number
+    Songs with FLAG_HEADER_HASH use their nonce prefix in place of the song hash
+    """
+    if flags & FLAG_HEADER_HASH:
+        return nonce_prefix + pack("<I", index)
+    if flags & FLAG_COUNTER_NONCES:
+        return sha256sum + pack("<I", index)
+    return sha256sum
+
+
+def merkle_leaf(index, tag):
+    return digest(b"\x00" + pack("<I", index) + tag)
+
+
+def merkle_root(leaves):
+    """Returns the root over a list of leaf hashes, the left subtree holds the largest power of two below the count"""
+    if len(leaves) == 1:
+        return leaves[0]
+    split = 1 << ((len(leaves) - 1).bit_length() - 1)
+    return digest(b"\x01" + merkle_root(leaves[:split]) + merkle_root(leaves[split:]))
+
+
+def chunk_sizes(wav_size, chunk_size):
+    """Returns the plaintext size of every chunk, the remainder chunk is always present"""
+    return [chunk_size] * (wav_size // chunk_size) + [wav_size % chunk_size]
+
+
+def chunk_offsets(data_offset, sizes):
+    """Returns the file offset of every chunk record, starting at data_offset"""
+    offsets = []
+    for size in sizes:
+        offsets.append(data_offset)
+        data_offset += RECORD_OVERHEAD + size
+    return offsets
+
+
+def metadata_size(flags):
+    """Returns the plaintext metadata size of a song with these flags"""
+    if flags & FLAG_COMPACT_METADATA:
+        return calcsize(COMPACT_METADATA_FORMAT)
+    return calcsize(METADATA_FORMAT)
+
+
+def metadata_aad(flags):
+    if flags & FLAG_COMPACT_METADATA:
+        return COMPACT_METADATA_AAD
+    return METADATA_AAD
+
+
+def header_format(flags):
+    fmt = HEADER_V2_FORMAT
+    if flags & FLAG_MERKLE_ROOT:
+        fmt += MERKLE_ROOT_FORMAT
+    if flags & FLAG_HEADER_HASH:
+        fmt += HEADER_HASH_FORMAT
+    return fmt
+
+
+def check_flags(flags):
+    """Raises ValueError if a v2 song cannot combine these flags"""
+    if flags & FLAG_HEADER_HASH and flags & HEADER_HASH_NEEDS != HEADER_HASH_NEEDS:
+        raise ValueError("a song hash in the header needs counter nonces and a merkle root")
+
+
+def header_size(version, flags=0):
+    if version == 1:
+        return NONCE_SIZE + calcsize(HEADER_V1_FORMAT) + MAC_SIZE
+    return PREFIX_SIZE + NONCE_SIZE + calcsize(header_format(flags)) + MAC_SIZE
+
+
+def pack_header(key, version, wave_header, metadata_size, chunk_size=CHUNK_SIZE, num_chunks=0, index_offset=0, flags=0,
+                root=None, sha256sum=None, nonce_prefix=None):
+    """Returns the encrypted header of a protected song, including the v2 prefix
+    The nonce is the first 12 bytes of the hash of everything it protects
+    """
+    if version == 1:
+        plaintext = pack(HEADER_V1_FORMAT, wave_header, metadata_size)
+        return seal_header(key, digest(plaintext)[:NONCE_SIZE], plaintext, HEADER_AAD)
+
+    prefix = pack(PREFIX_FORMAT, MAGIC, version, flags)
+    plaintext = pack(HEADER_V2_FORMAT, wave_header, metadata_size, chunk_size, num_chunks, index_offset)
+    if flags & FLAG_MERKLE_ROOT:
+        plaintext += root
+    if flags & FLAG_HEADER_HASH:
+        plaintext += sha256sum + nonce_prefix
+    return prefix + seal_header(key, digest(prefix + plaintext)[:NONCE_SIZE], plaintext, HEADER_AAD + prefix)
+
+
+def pack_index(key, sha256sum, offsets):
+    """Returns the authenticated chunk index trailer of a v2 song"""
+    table = pack("<{}I".format(len(offsets)), *offsets)
+    aad = INDEX_AAD + sha256sum + table
+    nonce = digest(sha256sum + table)[:NONCE_SIZE]
+    return seal(key, nonce, b"", aad) + table
+
+
+class SongInfo(object):
+    """Authenticated layout of a protected song"""
+
+    def __init__(self):
+        self.version = 1
+        self.flags = 0
+        self.wave_header = None
+        self.metadata_size = 0
+        self.metadata_offset = 0
+        self.metadata = None
+        self.sha256sum = None
+        self.chunk_size = CHUNK_SIZE
+        self.num_chunks = 0
+        self.index_offset = 0
+        self.merkle_root = None
+        # Set with FLAG_HEADER_HASH: the song hash from the header and the nonce prefix used as the chunk aad
+        self.header_sha256sum = None
+        self.nonce_prefix = None
+        self.data_offset = 0
+        self.sizes = []
+        self.offsets = []
+        # Set for chunk store manifests: the open store, the tag of every chunk and the end of the manifest
+        self.store = None
+        self.tags = None
+        self.manifest_end = 0
+
+    def close(self):
+        """Closes the chunk store of a manifest, songs have nothing to close"""
+        if self.store is not None:
+            self.store.close()
+            self.store = None
+
+    @property
+    def wav_size(self):
+        return int.from_bytes(self.wave_header[-4:], 'little')
+
+
+def read_exact(song, size, what):
+    data = song.read(size)
+    if len(data) != size:
+        raise FormatError(what, "is truncated")
+    return data
+
+
+def read_head(key, song):
+    """Authenticates the header and metadata of a protected song, or of a chunk store manifest
+    Args:
+        key (bytes): song encryption key
+        song (file): protected song opened for binary reading, positioned at the start
+    Returns:
+        SongInfo: the song without its chunk layout, with the file positioned after the metadata
+    """
+    info = SongInfo()
+
+    prefix = read_exact(song, PREFIX_SIZE, "header")
+    magic, version, flags = unpack(PREFIX_FORMAT, prefix)
+
+    if magic == MAGIC:
+        if version != VERSION:
+            raise FormatError("header", "has unsupported format version " + str(version))
+        if flags & ~KNOWN_FLAGS:
+            raise FormatError("header", "has unsupported flags " + hex(flags))
+        try:
+            check_flags(flags)
+        except ValueError as e:
+            raise FormatError("header", "flags " + hex(flags) + " do not go together, " + str(e))
+        info.version = version
+        info.flags = flags
+
+        record = read_exact(song, header_size(version, flags) - PREFIX_SIZE, "header")
+        plaintext = open_record(key, record[:NONCE_SIZE], record[-MAC_SIZE:], record[NONCE_SIZE:-MAC_SIZE],
+                                HEADER_AAD + prefix, "header")
+        fields = unpack(header_format(flags), plaintext)
+        info.wave_header, info.metadata_size, info.chunk_size, info.num_chunks, info.index_offset = fields[:5]
+        if flags & FLAG_MERKLE_ROOT:
+            info.merkle_root = fields[5]
+        if flags & FLAG_HEADER_HASH:
+            info.header_sha256sum, info.nonce_prefix = fields[6:8]
+    else:
+        # Version 1 songs start with the header nonce
+        record = prefix + read_exact(song, header_size(1) - PREFIX_SIZE, "header")
+        plaintext = open_record(key, record[:NONCE_SIZE], record[-MAC_SIZE:], record[NONCE_SIZE:-MAC_SIZE],
+                                HEADER_AAD, "header")
+        info.wave_header, info.metadata_size = unpack(HEADER_V1_FORMAT, plaintext)
+
+    if info.metadata_size != metadata_size(info.flags):
+        raise FormatError("header", "metadata size does not match the song flags")
+
+    info.metadata_offset = song.tell()
+    nonce = read_exact(song, NONCE_SIZE, "metadata")
+    tag = read_exact(song, MAC_SIZE, "metadata")
+    encrypted_metadata = read_exact(song, info.metadata_size, "metadata")
+    info.metadata = open_record(key, nonce, tag, encrypted_metadata, metadata_aad(info.flags), "metadata")
+    info.sha256sum = info.metadata[:SHA256_SIZE]
+    if info.header_sha256sum is not None and info.sha256sum != info.header_sha256sum:
+        raise FormatError("metadata", "belongs to another song, its hash does not match the header")
+
+    info.data_offset = song.tell()
+    return info
+
+
+def read_song(key, song, store_path=None):
+    """Authenticates the header, metadata and (v2) chunk index of a protected song
+    A chunk store manifest is followed into its store, which is left open in the returned info until info.close()
+    Args:
+        key (bytes): song encryption key
+        song (file): protected song or manifest opened for binary reading, positioned at the start
+        store_path (str): chunk store of a manifest, defaults to STORE_NAME next to it
+    Returns:
+        SongInfo: layout of the song, with the file positioned at the first chunk (or the manifest chunk list)
+    """
+    info = read_head(key, song)
+
+    marker = song.read(len(MANIFEST_MAGIC))
+    song.seek(info.data_offset)
+    if marker == MANIFEST_MAGIC:
+        if store_path is None:
+            store_path = path.join(path.dirname(song.name), STORE_NAME)
+        return read_manifest(song, info, store_path)
+
+    if info.version == 1:
+        info.sizes = chunk_sizes(info.wav_size, info.chunk_size)
+        info.num_chunks = len(info.sizes)
+        info.offsets = chunk_offsets(info.data_offset, info.sizes)
+        return info
+
+    if not info.chunk_size or info.num_chunks != info.wav_size // info.chunk_size + 1:
+        raise FormatError("header", "chunk layout does not match the song size")
+
+    song.seek(info.index_offset)
+    nonce = read_exact(song, NONCE_SIZE, "chunk index")
+    tag = read_exact(song, MAC_SIZE, "chunk index")
+    table = read_exact(song, 4 * info.num_chunks, "chunk index")
+    open_record(key, nonce, tag, b"", INDEX_AAD + info.sha256sum + table, "chunk index")
+
+    info.offsets = list(unpack("<{}I".format(info.num_chunks), table))
+    info.sizes = chunk_sizes(info.wav_size, info.chunk_size)
+
+    song.seek(info.data_offset)
+    return info
+
+
+def read_manifest(song, info, store_path):
+    """Reads the chunk list of a manifest positioned after its metadata and opens its chunk store
+    Returns:
+        SongInfo: info with the store offset of every chunk record in offsets and its tag in tags
+    """
+    if info.version != 1 and (not info.chunk_size or info.num_chunks != info.wav_size // info.chunk_size + 1):
+        raise FormatError("header", "chunk layout does not match the song size")
+    info.sizes = chunk_sizes(info.wav_size, info.chunk_size)
+    info.num_chunks = len(info.sizes)
+
+    _, version, count = unpack(MANIFEST_HEADER_FORMAT,
+                                   read_exact(song, calcsize(MANIFEST_HEADER_FORMAT), "manifest"))
+    if version != STORE_VERSION:
+        raise FormatError("manifest", "is not a version " + str(STORE_VERSION) + " manifest")
+    if count != info.num_chunks:
+        raise FormatError("manifest", "chunk count does not match the song size")
+
+    entry_size = calcsize(MANIFEST_ENTRY_FORMAT)
+    entries = read_exact(song, entry_size * count, "manifest")
+    info.offsets, info.tags = [], []
+    for i in range(count):
+        offset, tag = unpack(MANIFEST_ENTRY_FORMAT, entries[i * entry_size:(i + 1) * entry_size])
+        info.offsets.append(offset)
+        info.tags.append(tag)
+    info.manifest_end = song.tell()
+
+    try:
+        info.store = open(store_path, "rb")
+    except OSError as e:
+        raise FormatError("chunk store", "cannot be opened (" + str(e) + ")")
+    try:
+        read_store_header(info.store)
+    except FormatError:
+        info.close()
+        raise
+
+    song.seek(info.data_offset)
+    return info
+
+
+def read_store_header(store):
+    """Checks the magic and version at the start of a chunk store"""
+    magic, version = unpack(STORE_HEADER_FORMAT, read_exact(store, calcsize(STORE_HEADER_FORMAT), "chunk store"))
+    if magic != STORE_MAGIC or version != STORE_VERSION:
+        raise FormatError("chunk store", "is not a version " + str(STORE_VERSION) + " chunk store")
+
+
+def read_chunk(key, song, info, index):
+    """Returns the plaintext of chunk index (0 based), seeking to it through the song layout"""
+    what = "chunk " + str(index + 1)
+    if info.store is not None:
+        # A store entry is length(4) / nonce / ciphertext, the tag is in the manifest
+        if info.offsets[index] < calcsize(STORE_HEADER_FORMAT) + 4:
+            raise FormatError(what, "is outside the chunk store")
+        info.store.seek(info.offsets[index] - 4)
+        if unpack("<I", read_exact(info.store, 4, what))[0] != NONCE_SIZE + info.sizes[index]:
+            raise FormatError(what, "has the wrong size in the chunk store")
+        nonce = read_exact(info.store, NONCE_SIZE, what)
+        tag = info.tags[index]
+        encrypted_chunk = read_exact(info.store, info.sizes[index], what)
+    else:
+        song.seek(info.offsets[index])
+        nonce = read_exact(song, NONCE_SIZE, what)
+        tag = read_exact(song, MAC_SIZE, what)
+        encrypted_chunk = read_exact(song, info.sizes[index], what)
+    aad = chunk_aad(info.sha256sum, index, info.flags, info.nonce_prefix)
+    return open_record(key, nonce, tag, encrypted_chunk, aad, what)
+
+
+def read_tags(song, offsets):
+    """Returns the tag of every chunk record at offsets, without decrypting anything"""
+    tags = []
+    for index, offset in enumerate(offsets):
+        song.seek(offset + NONCE_SIZE)
+        tags.append(read_exact(song, MAC_SIZE, "chunk " + str(index + 1)))
+    return tags
+
+
+def tags_root(tags):
+    return merkle_root([merkle_leaf(index, tag) for index, tag in enumerate(tags)])
+
+
+def check_tree(song, info):
+    """Raises FormatError unless the chunk tags match the merkle root in the header, songs without one always pass"""
+    if info.merkle_root is None:
+        return
+    tags = info.tags if info.tags is not None else read_tags(song, info.offsets)
+    if tags_root(tags) != info.merkle_root:
+        raise FormatError("chunk tags", "do not match the merkle root")
+
+
+def song_end(info):
+    """Returns the expected size of the protected song file, or of the manifest"""
+    if info.tags is not None:
+        return info.manifest_end
+    if info.version == 1:
+        return info.offsets[-1] + RECORD_OVERHEAD + info.sizes[-1]
+    return info.index_offset + RECORD_OVERHEAD + 4 * info.num_chunks
+
+
+class ChunkStore(object):
+    """Content addressed chunk store, appended to in place"""
+
+    def __init__(self, store_path):
+        self.file = open(store_path, "a+b")
+        self.entries = {}
+        self.added = 0
+
+        self.file.seek(0, 2)
+        if self.file.tell() == 0:
+            self.file.write(pack(STORE_HEADER_FORMAT, STORE_MAGIC, STORE_VERSION))
+            self.size = self.file.tell()
+            return
+
+        # Rebuild the address table of an existing store
+        self.file.seek(0)
+        read_store_header(self.file)
+        while True:
+            length = self.file.read(4)
+            if not length:
+                break
+            if len(length) != 4:
+                raise FormatError("chunk store", "is truncated")
+            offset = self.file.tell()
+            self.entries[digest(read_exact(self.file, unpack("<I", length)[0], "chunk store"))] = offset
+        self.size = self.file.tell()
+
+    def add(self, nonce, ciphertext):
+        """Returns the store offset of the entry for nonce and ciphertext, writing it if it is new"""
+        body = nonce + ciphertext
+        address = digest(body)
+        offset = self.entries.get(address)
+        if offset is None:
+            if self.size + 4 + len(body) > MAX_STORE_SIZE:
+                raise FormatError("chunk store", "is full")
+            offset = self.size + 4
+            self.file.write(pack("<I", len(body)) + body)
+            self.size += 4 + len(body)
+            self.entries[address] = offset
+            self.added += 1
+        return offset
+
+    def close(self):
+        self.file.close()
+
+
+def pack_manifest(entries):
+    """Returns the manifest block for a list of (store offset, tag), one per chunk"""
+    return pack(MANIFEST_HEADER_FORMAT, MANIFEST_MAGIC, STORE_VERSION, len(entries)) + \
+        b"".join(pack(MANIFEST_ENTRY_FORMAT, offset, tag) for offset, tag in entries)
+
+
+def unpack_metadata(metadata):
+    """Returns (song hash, owner id, region ids, shared user ids) from plaintext metadata"""
+    fields = unpack(METADATA_FORMAT, metadata)
+    sha256sum, owner, num_regions, num_users = fields[:4]
+    rids = fields[4:4 + METADATA_REGIONS]
+    uids = fields[4 + METADATA_REGIONS:]
+    return sha256sum, owner, list(rids[:num_regions]), list(uids[:num_users])
+
+
+def pack_metadata(sha256sum, owner, rids, uids):
+    """Returns plaintext metadata, the inverse of unpack_metadata"""
+    if len(rids) > METADATA_REGIONS or len(uids) > METADATA_USERS:
+        raise FormatError("metadata", "has more than {} regions or {} users".format(METADATA_REGIONS, METADATA_USERS))
+    return pack(METADATA_FORMAT, sha256sum, owner, len(rids), len(uids),
+                *(list(rids) + [0] * (METADATA_REGIONS - len(rids))),
+                *(list(uids) + [0] * (METADATA_USERS - len(uids))))
+
+
+def pack_bits(positions, words):
+    """Returns the bitmap words with the bit of every position set"""
+    bitmap = [0] * words
+    for position in positions:
+        if not 0 <= position < 32 * words:
+            raise FormatError("metadata", "has no bit for entry " + str(position))
+        bitmap[position // 32] |= 1 << (position % 32)
+    return bitmap
+
+
+def unpack_bits(bitmap):
+    """Returns the positions of the set bits of bitmap words, in order"""
+    return [i for i in range(32 * len(bitmap)) if bitmap[i // 32] >> (i % 32) & 1]
+
+
+def unpack_compact_metadata(metadata):
+    """Returns (song hash, owner id, region positions, shared user positions) from plaintext compact metadata
+    Positions index the region and user secrets files
+    """
+    fields = unpack(COMPACT_METADATA_FORMAT, metadata)
+    sha256sum, version, owner = fields[:3]
+    if version != COMPACT_VERSION:
+        raise FormatError("metadata", "has unsupported version " + str(version))
+    region_bits = fields[3:3 + REGION_WORDS]
+    user_bits = fields[3 + REGION_WORDS:]
+    return sha256sum, owner, unpack_bits(region_bits), unpack_bits(user_bits)
+
+
+def pack_compact_metadata(sha256sum, owner, regions, users):
+    """Returns plaintext compact metadata, the inverse of unpack_compact_metadata"""
+    return pack(COMPACT_METADATA_FORMAT, sha256sum, COMPACT_VERSION, owner,
+                *(pack_bits(regions, REGION_WORDS) + pack_bits(users, USER_WORDS)))
+
+
+def seal_metadata(key, metadata, nonce, flags=0):
+    """Returns the metadata record as stored after the header, nonce must never be reused"""
+    return seal(key, nonce, metadata, metadata_aad(flags))
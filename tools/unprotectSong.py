@@ -1,19 +1,17 @@
 #!/usr/bin/env python3
 
 #Used to load json files
-from json import load
+from json import load, dump
 #used to parse arguments in the command line
 from argparse import ArgumentParser
+#used to find songs and check them in parallel
+from os import path, walk, cpu_count, SEEK_END
+from fnmatch import fnmatch
+from multiprocessing import Pool
+import sys
 
-# Used for decryption
-
-import nacl.bindings as b
-import nacl.exceptions as exc
-import nacl.hash
-import nacl.encoding
-
-# calculating the chunk remainder
-from math import floor
+# Used for decryption, v1 and v2 songs are both read through the shared layout
+import drm_format
 
 # TODO: Move decryption processes to separate functions
 # TODO: Add argument parsing
@@ -28,17 +26,6 @@ def decrypt_song(keys_loc, infile, outfile):
         Outputs the decrypted version of the encrypted song
 
     """
-    # Configuration Variables
-    mac_size = 16           # poly1305 mac size
-    hash_byte_size = 12     # Take 12 bytes of a 256 bit hash
-    aad_size = 4            # Use 4 bytes to store aad size
-    wave_header_size = 44
-    metadata_size_allocation = 4
-    encrypted_wave_header_size = wave_header_size + metadata_size_allocation + mac_size
-    chunk_size = 16000
-    
-    print("Setting chunksize to " + str(chunk_size) + " bytes")
-
     #opens decrypted and encrypted song locations
     encrypted_song = open(infile, 'rb')    
     decrypted_song = open(outfile, 'wb')   
@@ -53,110 +40,180 @@ def decrypt_song(keys_loc, infile, outfile):
 
     print("Starting decrypt song")
 
-    #nonce to decrypt song
-    nonce = encrypted_song.read(hash_byte_size)
-    print("Wave Header Nonce: " + str(nonce))
-
-    #read encrypted file header
-    encrypted_wave_header = encrypted_song.read(encrypted_wave_header_size)
-
-    aad = b"wave_header\0"
-
-    # Encrypt Wav Header
-    wav_header = b.crypto_aead_chacha20poly1305_ietf_decrypt(encrypted_wave_header, aad, nonce, key)
-
-    #metadata song
-    metadata_size = int.from_bytes(wav_header[-metadata_size_allocation:], 'little')
-    print("Metadata size: " + str(metadata_size))
-
-    # Strip metadata size off wave_header
-    wav_header = wav_header[:wave_header_size]
+    # Authenticate the header, metadata and chunk index (v2)
+    info = drm_format.read_song(key, encrypted_song)
+    print("Format version: " + str(info.version))
+    print("Metadata size: " + str(info.metadata_size))
+    print("Decrypted metadata: " + str(info.metadata))
 
     #writes out decrypted song header
-    decrypted_song.write(wav_header)
+    decrypted_song.write(info.wave_header)
 
     #song size
-    song_info_size = int.from_bytes(wav_header[-4:], byteorder='little')
-    print("Song size: " + str(song_info_size))
-
-    # Calculate # of chunks to read
-    chunk_to_read = floor(song_info_size / chunk_size)
-    print("Chunks to read: " + str(chunk_to_read))
+    print("Song size: " + str(info.wav_size))
+    print("Setting chunksize to " + str(info.chunk_size) + " bytes")
+    print("Chunks to read: " + str(info.num_chunks))
 
-    # Calculate remainder
-    chunk_remainder = song_info_size % chunk_size
-    print("Chunk remainder size: " + str(chunk_remainder))
-
-    #nonce to decrypt metadata
-    nonce = encrypted_song.read(hash_byte_size)
-    print("Metadata nonce: " + str(nonce))
-
-    aad = b"meta_data\0"
-
-    #encrypted metadata
-    encrypted_metadata_tag = encrypted_song.read(mac_size)
-    print("Metadata tag: " + str(encrypted_metadata_tag) + " Size: " + str(len(encrypted_metadata_tag)))
-    encrypted_metadata = encrypted_song.read(metadata_size)
-    print("Encrypted metadata: " + str(encrypted_metadata) + " Size: " + str(len(encrypted_metadata)))
-
-    #encrypted meta data and encrypted meta data tag
-    encrypted_metadata_combined = encrypted_metadata + encrypted_metadata_tag
-
-    print("Encrypted data: " + str(encrypted_metadata_combined))
-    metadata = b.crypto_aead_chacha20poly1305_ietf_decrypt(encrypted_metadata_combined, aad, nonce, key)
-
-    print("Decrypted metadata: " + str(metadata))
-    
     # Get the sha256 sum from the metadata to use in aad
-    sha256sum = metadata[:32]
-    print("Sha256sum " + str(sha256sum))
-
-    #reads individual chunks
-    for i in range(1, chunk_to_read + 1):
-        #print("Read chunk: " + str(i))
-        nonce = encrypted_song.read(hash_byte_size)
-        #print("Chunk " + str(i) + " Nonce: " + str(nonce))
-        aad = sha256sum
-        encrypted_chunk_tag = encrypted_song.read(mac_size)
-        encrypted_chunk_wo_tag = encrypted_song.read(chunk_size)
+    print("Sha256sum " + str(info.sha256sum))
 
-        #encrypted chunk
-        encrypted_chunk = encrypted_chunk_wo_tag + encrypted_chunk_tag
-
-        #decrypted song chunk
-        song_chunk = b.crypto_aead_chacha20poly1305_ietf_decrypt(encrypted_chunk, aad, nonce, key)
+    #reads individual chunks, the last one is the remainder
+    for i in range(info.num_chunks):
+        song_chunk = drm_format.read_chunk(key, encrypted_song, info, i)
 
         #writes out decrypted version of the song
         decrypted_song.write(song_chunk)
 
-        if i == 1:
-            print("Read chunk: " + str(i))
-            print("Chunk " + str(i) + " Nonce: " + str(nonce))
-            print("Chunk " + str(i) + " Tag: " + str(encrypted_chunk_tag))
-            print("Chunk " + str(i) + " Decrypted Chunk :" + str(song_chunk))
+    #closes encrypted and decrypted song, and the chunk store of a manifest
+    info.close()
+    encrypted_song.close()
+    decrypted_song.close()
+
+    print("Decryption Success")
+    
+
+def parse_chunks(spec):
+    """Returns the set of chunk numbers (1 based) in a spec like "1-10,50", None for every chunk"""
+    if not spec:
+        return None
+    chunks = set()
+    for part in spec.split(","):
+        first, _, last = part.partition("-")
+        chunks.update(range(int(first), int(last or first) + 1))
+    return chunks
 
-    #nonce to decrypt remainder
-    nonce = encrypted_song.read(hash_byte_size)
-    print("Remainder Nonce: " + str(nonce))
-    aad = sha256sum
 
-    encrypted_chunk_tag = encrypted_song.read(mac_size)
-    encrypted_chunk_wo_tag = encrypted_song.read(chunk_remainder)
+def verify_song(key, infile, chunks=None):
+    """Description checks every tag of an encrypted song without writing any plaintext
+    Args:
+        key: song encryption key
+        infile: file path to the encrypted song
+        chunks: chunk numbers (1 based) to decrypt, None for all of them
+    Returns:
+        dict: report for the song, status is "ok", "corrupt" or "error"
+    """
+    report = {
+        "file": infile,
+        "status": "error",
+        "version": None,
+        "header": False,
+        "metadata": False,
+        "merkle": None,
+        "chunks": 0,
+        "checked_chunks": 0,
+        "bad_chunks": [],
+    }
+
+    try:
+        with open(infile, 'rb') as encrypted_song:
+            # Header, metadata and the chunk index of v2 songs
+            try:
+                info = drm_format.read_song(key, encrypted_song)
+            except drm_format.FormatError as e:
+                report["header"] = e.what != "header"
+                report["metadata"] = e.what not in ("header", "metadata")
+                report["error"] = str(e)
+                report["status"] = "corrupt"
+                return report
+            report["version"] = info.version
+            report["header"] = True
+            report["metadata"] = True
+            report["chunks"] = info.num_chunks
+
+            try:
+                # The merkle root ties every chunk tag to its position, from the tags alone
+                if info.merkle_root is not None:
+                    try:
+                        drm_format.check_tree(encrypted_song, info)
+                        report["merkle"] = True
+                    except drm_format.FormatError as e:
+                        report["merkle"] = False
+                        report["error"] = str(e)
+
+                # Every chunk is authenticated against the song hash at the start of the metadata
+                for i in range(info.num_chunks):
+                    if chunks is not None and i + 1 not in chunks:
+                        continue
+                    report["checked_chunks"] += 1
+                    try:
+                        drm_format.read_chunk(key, encrypted_song, info, i)
+                    except drm_format.FormatError:
+                        report["bad_chunks"].append(i + 1)
+            finally:
+                info.close()
+
+            encrypted_song.seek(0, SEEK_END)
+            if encrypted_song.tell() != drm_format.song_end(info):
+                report["error"] = "unexpected file size for the song layout"
+                report["status"] = "corrupt"
+                return report
+
+        report["status"] = "corrupt" if report["bad_chunks"] or report["merkle"] is False else "ok"
+    except OSError as e:
+        report["error"] = str(e)
+
+    return report
+
+
+# Song key and chunk selection for a verify worker process, set once when the pool starts
+_verify_key = None
+_verify_chunks = None
+
+
+def _init_verify_worker(key, chunks):
+    global _verify_key, _verify_chunks
+    _verify_key = key
+    _verify_chunks = chunks
+
+
+def _verify_worker(infile):
+    return verify_song(_verify_key, infile, _verify_chunks)
+
+
+def find_songs(paths, pattern):
+    """Yields the given files and every file under the given directories that matches pattern
+    Chunk stores are skipped, they are read through the manifests of a stored library
+    """
+    for song_path in paths:
+        if path.isdir(song_path):
+            for root, dirs, files in walk(song_path):
+                dirs.sort()
+                for name in sorted(files):
+                    if fnmatch(name, pattern) and name != drm_format.STORE_NAME:
+                        yield path.join(root, name)
+        elif path.basename(song_path) != drm_format.STORE_NAME:
+            yield song_path
+
+
+def verify_songs(key, paths, pattern, workers, report_loc, chunks=None):
+    """Description verifies songs across a pool of processes and writes a json report
+    Args:
+        key: song encryption key
+        paths: songs and directories of songs to check
+        pattern: file name pattern for songs found in directories
+        workers: number of songs checked at once
+        report_loc: path of the json report, stdout if None
+        chunks: chunk numbers (1 based) to decrypt in each song, None for all of them
+    Returns:
+        int: number of songs that did not verify
+    """
+    songs = list(find_songs(paths, pattern))
 
-    encrypted_chunk = encrypted_chunk_wo_tag + encrypted_chunk_tag
+    with Pool(workers, initializer=_init_verify_worker, initargs=(key, chunks)) as pool:
+        reports = pool.map(_verify_worker, songs, chunksize=1)
 
-    #decrypted song chunk remainder
-    song_chunk = b.crypto_aead_chacha20poly1305_ietf_decrypt(encrypted_chunk, aad, nonce, key)
+    failed = sum(report["status"] != "ok" for report in reports)
+    print("Verified {} songs, {} failed".format(len(reports), failed), file=sys.stderr)
 
-    #writes out decrypted shunk remainder
-    decrypted_song.write(song_chunk)
+    if report_loc is None:
+        dump(reports, sys.stdout, indent=4)
+        print()
+    else:
+        with open(report_loc, "w") as report_file:
+            dump(reports, report_file, indent=4)
 
-    #closes encrypted and decrypted song
-    encrypted_song.close()
-    decrypted_song.close()
+    return failed
 
-    print("Decryption Success")
-    
 
 def main():
     """Main function
@@ -167,10 +224,25 @@ def main():
         none
     """
     parser = ArgumentParser(description='main interface to decrytp song')
-    parser.add_argument('--outfile', help='path to save the protected song', required=True)
-    parser.add_argument('--infile', help='path to unprotected song', required=True)
+    parser.add_argument('--outfile', help='path to save the protected song')
+    parser.add_argument('--infile', nargs='+', help='path to unprotected song, or songs and directories with --verify-only', required=True)
+    parser.add_argument('--verify-only', action='store_true', help='check every tag without writing plaintext')
+    parser.add_argument('--pattern', default='*', help='file name pattern for songs in directories with --verify-only')
+    parser.add_argument('--workers', type=int, default=cpu_count(), help='songs checked at once with --verify-only')
+    parser.add_argument('--report', help='json report path with --verify-only, defaults to stdout')
+    parser.add_argument('--chunks', help='chunk numbers to decrypt with --verify-only, e.g. 1-10,50, defaults to all')
     args = parser.parse_args()
-    decrypt_song("keys.json", args.infile, args.outfile)
+
+    if args.verify_only:
+        keys_file = load(open("keys.json", "r"))
+        key = bytes.fromhex(keys_file["key"])
+        failed = verify_songs(key, args.infile, args.pattern, args.workers, args.report, parse_chunks(args.chunks))
+        exit(1 if failed else 0)
+
+    if not args.outfile or len(args.infile) != 1:
+        parser.error('decrypting takes a single --infile and an --outfile')
+
+    decrypt_song("keys.json", args.infile[0], args.outfile)
 
 #initites main()
 if __name__ == '__main__':